@@ -0,0 +1,73 @@
+#!/bin/sh
+# Compare ingest with and without a huge-page backed image mapping.
+#
+#   ./bench_hugepages.sh [workdir]
+#
+# Environment knobs:
+#   SIZE_KIB   image size in KiB        (default 67108864 = 64 GiB)
+#   INODES     inode count              (default 1048576)
+#   FILES      files added per run      (default 20000)
+#   FILE_KIB   size of each generated file (default 4)
+#
+# Each run starts an adder daemon on a fresh copy of the empty image, adds
+# FILES files through one client and reports the ingest rate and how much of
+# the image ended up mapped with 2 MiB pages (FilePmdMapped). When perf is
+# installed the daemon's dTLB misses are counted too.
+set -eu
+
+WORK=${1:-./bench_hugepages.work}
+SIZE_KIB=${SIZE_KIB:-67108864}
+INODES=${INODES:-1048576}
+FILES=${FILES:-20000}
+FILE_KIB=${FILE_KIB:-4}
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+mkdir -p "$WORK/adds"
+
+gcc -O2 -std=c17 -Wall -Wextra -pthread "$HERE/mkfs_builder_final.c" -o "$WORK/mkfs_builder"
+gcc -O2 -std=c17 -Wall -Wextra -pthread "$HERE/mkfs_adder_final.c" -o "$WORK/mkfs_adder"
+
+now_ms() { date +%s%3N; }
+
+i=0
+while [ "$i" -lt "$FILES" ]; do
+    [ -f "$WORK/adds/a$i" ] || head -c $((FILE_KIB * 1024)) /dev/urandom > "$WORK/adds/a$i"
+    i=$((i + 1))
+done
+rm -f "$WORK/empty.img"
+"$WORK/mkfs_builder" --image "$WORK/empty.img" --size-kib "$SIZE_KIB" --inodes "$INODES" > /dev/null
+
+for mode in off on; do
+    img="$WORK/run-$mode.img"
+    sock="$WORK/run-$mode.sock"
+    rm -f "$img" "$sock"
+    cp --sparse=always "$WORK/empty.img" "$img"
+    flag=""
+    [ "$mode" = on ] && flag="--hugepages"
+
+    "$WORK/mkfs_adder" --input "$img" --daemon "$sock" $flag > /dev/null &
+    daemon=$!
+    while [ ! -S "$sock" ]; do sleep 0.05; done
+    perf_pid=""
+    if command -v perf > /dev/null 2>&1; then
+        perf stat -e dTLB-load-misses,dTLB-store-misses -p "$daemon" -o "$WORK/perf-$mode.txt" &
+        perf_pid=$!
+    fi
+
+    t0=$(now_ms)
+    ls "$WORK/adds" | sed "s|^|--file\n$WORK/adds/|" | xargs -d '\n' -n 2000 \
+        "$WORK/mkfs_adder" --connect "$sock" > /dev/null
+    t1=$(now_ms)
+
+    pmd=$(awk '/FilePmdMapped/ { print $2 }' "/proc/$daemon/smaps_rollup" 2>/dev/null || echo "?")
+    [ -n "$perf_pid" ] && kill -INT "$perf_pid" && wait "$perf_pid" || true
+    kill -TERM "$daemon"
+    wait "$daemon" || true
+
+    ms=$((t1 - t0))
+    [ "$ms" -gt 0 ] || ms=1
+    echo "hugepages $mode: $FILES files in $ms ms ($((FILES * 1000 / ms)) files/s), FilePmdMapped ${pmd} kB"
+    if [ -n "$perf_pid" ]; then
+        grep -E 'dTLB-(load|store)-misses' "$WORK/perf-$mode.txt" | sed 's/^ */    /'
+    fi
+done
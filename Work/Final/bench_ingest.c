@@ -0,0 +1,468 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread bench_ingest.c -o bench_ingest
+//
+// End-to-end ingest benchmark. Generates a reproducible corpus with
+// mkfs_builder --generate, then for each fill level builds a fresh image,
+// fills it to that level with a second corpus, and adds the first through an
+// adder daemon while timing every request. One CSV row per fill level:
+//   workload,seed,fill_pct,files,failed,mib,seconds,files_per_s,mib_per_s,
+//   p50_us,p99_us,fragmented_pct,extents_per_file,free_runs,largest_free_mib
+// Latency is from sending ADD to its reply, so it includes the daemon's group
+// commit; --window requests are kept in flight.
+#include "minivsfs.h"
+#include <dirent.h>
+#include <ftw.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define BENCH_MAX_FILLS 16
+
+typedef struct {
+    const char* builder;
+    const char* adder;
+    const char* work;
+    const char* workload;
+    uint64_t seed;
+    uint64_t files;
+    uint64_t size_kib;
+    uint64_t inodes;
+    unsigned window;
+    unsigned fills[BENCH_MAX_FILLS];
+    int fill_count;
+} bench_args_t;
+
+typedef struct {
+    char** paths;
+    uint64_t* sizes;
+    uint64_t count;
+} corpus_t;
+
+typedef struct {
+    uint64_t files;
+    uint64_t failed;
+    uint64_t bytes;
+    uint64_t ns;
+    uint64_t* latency_ns;
+} ingest_result_t;
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Run a tool with its output discarded, or in the background when pid_out is set
+int run_tool(char* const argv[], pid_t* pid_out) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Cannot start tool");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        execv(argv[0], argv);
+        perror("Cannot run tool");
+        _exit(127);
+    }
+    if (pid_out) {
+        *pid_out = pid;
+        return 0;
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+int generate(const bench_args_t* args, const char* dir, const char* workload, uint64_t seed, uint64_t files,
+             uint64_t total_kib) {
+    char seed_s[32], files_s[32], total_s[32];
+    snprintf(seed_s, sizeof(seed_s), "%" PRIu64, seed);
+    snprintf(files_s, sizeof(files_s), "%" PRIu64, files);
+    snprintf(total_s, sizeof(total_s), "%" PRIu64, total_kib);
+    char* argv[] = {(char*)args->builder, "--generate", (char*)dir, "--workload", (char*)workload,
+                    "--seed", seed_s, "--files", files_s, "--total-kib", total_s, NULL};
+    return run_tool(argv, NULL);
+}
+
+int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Generate a corpus into dir unless a complete one is already there. It is
+// generated into dir.partial and renamed into place once the generator
+// succeeds, so a run that stopped part way never leaves a dir to be reused.
+int ensure_corpus(const bench_args_t* args, const char* dir, const char* workload, uint64_t seed, uint64_t files,
+                  uint64_t total_kib) {
+    struct stat st;
+    if (stat(dir, &st) == 0) {
+        return 0;
+    }
+    char partial[PATH_MAX];
+    snprintf(partial, sizeof(partial), "%s.partial", dir);
+    if (stat(partial, &st) == 0 && nftw(partial, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+        perror("Cannot remove partial corpus");
+        return -1;
+    }
+    if (generate(args, partial, workload, seed, files, total_kib) != 0) {
+        return -1;
+    }
+    if (rename(partial, dir) != 0) {
+        perror("Cannot move corpus into place");
+        return -1;
+    }
+    return 0;
+}
+
+int load_corpus(corpus_t* c, const char* dir) {
+    memset(c, 0, sizeof(*c));
+    struct dirent** entries;
+    int n = scandir(dir, &entries, NULL, alphasort);
+    if (n < 0) {
+        perror("Cannot read corpus directory");
+        return -1;
+    }
+    c->paths = calloc((size_t)n + 1, sizeof(char*));
+    c->sizes = calloc((size_t)n + 1, sizeof(uint64_t));
+    for (int i = 0; i < n; i++) {
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+        if (c->paths && c->sizes && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            c->paths[c->count] = realpath(path, NULL);
+            c->sizes[c->count++] = (uint64_t)st.st_size;
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return c->paths && c->sizes ? 0 : -1;
+}
+
+void free_corpus(corpus_t* c) {
+    for (uint64_t i = 0; i < c->count; i++) {
+        free(c->paths[i]);
+    }
+    free(c->paths);
+    free(c->sizes);
+}
+
+int daemon_connect(const char* sock_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock_path);
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        usleep(10000); // the daemon may still be mapping the image
+    }
+    fprintf(stderr, "Cannot connect to adder daemon on %s\n", sock_path);
+    return -1;
+}
+
+// Add files [0, count) of c through the daemon, up to window requests in flight
+int daemon_add(int fd, const corpus_t* c, uint64_t count, unsigned window, ingest_result_t* r) {
+    uint64_t* sent_at = calloc(window, sizeof(uint64_t));
+    char buf[4096];
+    size_t have = 0;
+    uint64_t sent = 0, done = 0;
+    uint64_t start = now_ns();
+    if (!sent_at) {
+        return -1;
+    }
+
+    while (done < count) {
+        for (; sent < count && sent - done < window; sent++) {
+            char line[PATH_MAX + 8];
+            int len = snprintf(line, sizeof(line), "ADD %s\n", c->paths[sent]);
+            sent_at[sent % window] = now_ns();
+            if (write(fd, line, (size_t)len) != len) {
+                perror("Failed to send request");
+                free(sent_at);
+                return -1;
+            }
+        }
+        ssize_t n = read(fd, buf + have, sizeof(buf) - have);
+        if (n <= 0) {
+            fprintf(stderr, "Adder daemon closed the connection\n");
+            free(sent_at);
+            return -1;
+        }
+        have += (size_t)n;
+        uint64_t now = now_ns();
+        char* line = buf;
+        char* nl;
+        while ((nl = memchr(line, '\n', have - (size_t)(line - buf))) != NULL) {
+            if (r->latency_ns) {
+                r->latency_ns[done] = now - sent_at[done % window];
+            }
+            if (strncmp(line, "OK", 2) != 0) {
+                r->failed++;
+            } else {
+                r->bytes += c->sizes[done];
+            }
+            done++;
+            line = nl + 1;
+        }
+        have -= (size_t)(line - buf);
+        memmove(buf, line, have);
+    }
+    r->files = count;
+    r->ns = now_ns() - start;
+    free(sent_at);
+    return 0;
+}
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t percentile(const uint64_t* sorted, uint64_t n, unsigned pct) {
+    return n ? sorted[(n - 1) * pct / 100] : 0;
+}
+
+// Fragmentation of the image: files stored in more than one extent, extents
+// per file, and how the free space is split up
+void measure_fragmentation(const char* img, double* fragmented_pct, double* extents_per_file, uint64_t* free_runs,
+                           uint64_t* largest_free) {
+    fs_image_t fs;
+    *fragmented_pct = *extents_per_file = 0;
+    *free_runs = *largest_free = 0;
+    if (fs_open(&fs, img, NULL, 0) != 0) {
+        return;
+    }
+    uint64_t files = 0, fragmented = 0, extents = 0;
+    for (uint64_t i = 1; i <= fs.sb->inode_count; i++) {
+        if (!bitmap_test(fs.inode_bitmap, i - 1)) {
+            continue;
+        }
+        const inode_t* ino = fs_inode(&fs, (uint32_t)i);
+        if ((ino->mode & 0170000) != 0100000) {
+            continue;
+        }
+        uint64_t blocks = (ino->size_bytes + BS - 1) / BS;
+        uint64_t runs = 0;
+        uint32_t prev = 0;
+        for (uint64_t b = 0; b < blocks; b++) {
+            uint32_t blk = inode_block_at(&fs, ino, b);
+            runs += blk != 0 && blk != prev + 1;
+            prev = blk;
+        }
+        files++;
+        extents += runs;
+        fragmented += runs > 1;
+    }
+    uint64_t run = 0;
+    for (uint64_t bit = 0; bit <= fs.sb->data_region_blocks; bit++) {
+        if (bit < fs.sb->data_region_blocks && !bitmap_test(fs.data_bitmap, bit)) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            (*free_runs)++;
+            *largest_free = run > *largest_free ? run : *largest_free;
+        }
+        run = 0;
+    }
+    if (files > 0) {
+        *fragmented_pct = 100.0 * (double)fragmented / (double)files;
+        *extents_per_file = (double)extents / (double)files;
+    }
+    fs_close(&fs);
+}
+
+int bench_fill_level(const bench_args_t* args, const corpus_t* corpus, const corpus_t* filler, unsigned fill_pct) {
+    char img[PATH_MAX], sock[PATH_MAX], size_s[32], inodes_s[32];
+    snprintf(img, sizeof(img), "%s/bench.img", args->work);
+    snprintf(sock, sizeof(sock), "%s/bench.sock", args->work);
+    snprintf(size_s, sizeof(size_s), "%" PRIu64, args->size_kib);
+    snprintf(inodes_s, sizeof(inodes_s), "%" PRIu64, args->inodes);
+    char* build_argv[] = {(char*)args->builder, "--image", img, "--size-kib", size_s, "--inodes", inodes_s, NULL};
+    if (run_tool(build_argv, NULL) != 0) {
+        return -1;
+    }
+
+    // Filler files up to fill_pct of the data region
+    uint64_t data_blocks = 0;
+    fs_image_t fs;
+    if (fs_open(&fs, img, NULL, 0) == 0) {
+        data_blocks = fs.sb->data_region_blocks;
+        fs_close(&fs);
+    }
+    uint64_t fill_files = 0, fill_blocks = 0;
+    for (; fill_files < filler->count; fill_files++) {
+        uint64_t need = (filler->sizes[fill_files] + BS - 1) / BS;
+        need += map_blocks_needed(need);
+        if ((fill_blocks + need) * 100 > data_blocks * fill_pct) {
+            break;
+        }
+        fill_blocks += need;
+    }
+
+    unlink(sock);
+    pid_t daemon_pid;
+    char* daemon_argv[] = {(char*)args->adder, "--input", img, "--daemon", sock, NULL};
+    if (run_tool(daemon_argv, &daemon_pid) != 0) {
+        return -1;
+    }
+    int rc = -1;
+    int fd = daemon_connect(sock);
+    ingest_result_t fill, r;
+    memset(&fill, 0, sizeof(fill));
+    memset(&r, 0, sizeof(r));
+    r.latency_ns = calloc(corpus->count + 1, sizeof(uint64_t));
+    if (fd >= 0 && r.latency_ns && daemon_add(fd, filler, fill_files, 64, &fill) == 0 &&
+        daemon_add(fd, corpus, corpus->count, args->window, &r) == 0) {
+        rc = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+
+    if (rc == 0) {
+        double fragmented_pct, extents_per_file;
+        uint64_t free_runs, largest_free;
+        measure_fragmentation(img, &fragmented_pct, &extents_per_file, &free_runs, &largest_free);
+        qsort(r.latency_ns, r.files, sizeof(uint64_t), compare_u64);
+        double secs = (double)r.ns / 1e9;
+        double mib = (double)r.bytes / (1024.0 * 1024.0);
+        printf("%s,%" PRIu64 ",%u,%" PRIu64 ",%" PRIu64 ",%.1f,%.3f,%.0f,%.1f,%.1f,%.1f,%.1f,%.2f,%" PRIu64 ",%.1f\n",
+               args->workload, args->seed, fill_pct, r.files, r.failed + fill.failed, mib, secs,
+               (double)r.files / secs, mib / secs, (double)percentile(r.latency_ns, r.files, 50) / 1000.0,
+               (double)percentile(r.latency_ns, r.files, 99) / 1000.0, fragmented_pct, extents_per_file, free_runs,
+               (double)largest_free * BS / (1024.0 * 1024.0));
+        fflush(stdout);
+    }
+    free(r.latency_ns);
+    unlink(img);
+    return rc;
+}
+
+void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s --builder <mkfs_builder> --adder <mkfs_adder> [--work <dir>] [--seed <n>]\n"
+                    "          [--workload tiny|lognormal|bimodal] [--files <n>] [--fill <pct>[,<pct>...]]\n"
+                    "          [--size-kib <n>] [--inodes <n>] [--window <n>]\n", prog);
+}
+
+int parse_args(int argc, char* argv[], bench_args_t* args) {
+    memset(args, 0, sizeof(*args));
+    args->work = "./bench_ingest.work";
+    args->workload = "lognormal";
+    args->seed = 1;
+    args->files = 2000;
+    args->size_kib = 1048576;
+    args->inodes = 65536;
+    args->window = 16;
+    args->fills[0] = 0;
+    args->fills[1] = 25;
+    args->fills[2] = 50;
+    args->fill_count = 3;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return -1;
+        }
+        const char* v = argv[++i];
+        if (strcmp(argv[i - 1], "--builder") == 0) {
+            args->builder = v;
+        } else if (strcmp(argv[i - 1], "--adder") == 0) {
+            args->adder = v;
+        } else if (strcmp(argv[i - 1], "--work") == 0) {
+            args->work = v;
+        } else if (strcmp(argv[i - 1], "--workload") == 0) {
+            args->workload = v;
+        } else if (strcmp(argv[i - 1], "--seed") == 0) {
+            args->seed = strtoull(v, NULL, 10);
+        } else if (strcmp(argv[i - 1], "--files") == 0) {
+            args->files = strtoull(v, NULL, 10);
+        } else if (strcmp(argv[i - 1], "--size-kib") == 0) {
+            args->size_kib = strtoull(v, NULL, 10);
+        } else if (strcmp(argv[i - 1], "--inodes") == 0) {
+            args->inodes = strtoull(v, NULL, 10);
+        } else if (strcmp(argv[i - 1], "--window") == 0) {
+            args->window = (unsigned)atoi(v);
+        } else if (strcmp(argv[i - 1], "--fill") == 0) {
+            args->fill_count = 0;
+            for (const char* p = v; *p && args->fill_count < BENCH_MAX_FILLS; p += strcspn(p, ",") + (p[strcspn(p, ",")] != 0)) {
+                unsigned pct = (unsigned)atoi(p);
+                if (pct >= 100) {
+                    return -1;
+                }
+                args->fills[args->fill_count++] = pct;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return args->builder && args->adder && args->window > 0 && args->fill_count > 0 ? 0 : -1;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+    bench_args_t args;
+    if (parse_args(argc, argv, &args) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    // Tools are run by path from the child, so make them absolute
+    char builder[PATH_MAX], adder[PATH_MAX];
+    if (!realpath(args.builder, builder) || !realpath(args.adder, adder)) {
+        perror("Cannot find builder or adder");
+        return 1;
+    }
+    args.builder = builder;
+    args.adder = adder;
+    if (mkdir(args.work, 0755) != 0 && errno != EEXIST) {
+        perror("Cannot create work directory");
+        return 1;
+    }
+
+    // The corpus under test, and filler (lognormal, another seed) for the
+    // largest fill level, each named by everything that decides its content
+    unsigned max_fill = 0;
+    for (int i = 0; i < args.fill_count; i++) {
+        max_fill = args.fills[i] > max_fill ? args.fills[i] : max_fill;
+    }
+    uint64_t fill_kib = args.size_kib * max_fill / 100;
+    char corpus_dir[PATH_MAX], fill_dir[PATH_MAX];
+    snprintf(corpus_dir, sizeof(corpus_dir), "%s/%s-%" PRIu64 "-%" PRIu64, args.work, args.workload, args.seed, args.files);
+    snprintf(fill_dir, sizeof(fill_dir), "%s/fill-%" PRIu64 "-%" PRIu64, args.work, args.seed + 1, fill_kib);
+    // (no filler at all without a fill level: a total of 0 would not stop the generator)
+    if (ensure_corpus(&args, corpus_dir, args.workload, args.seed, args.files, 0) != 0 ||
+        (fill_kib > 0 && ensure_corpus(&args, fill_dir, "lognormal", args.seed + 1, UINT32_MAX, fill_kib) != 0)) {
+        return 1;
+    }
+
+    corpus_t corpus, filler;
+    memset(&filler, 0, sizeof(filler));
+    if (load_corpus(&corpus, corpus_dir) != 0 || (fill_kib > 0 && load_corpus(&filler, fill_dir) != 0)) {
+        return 1;
+    }
+    printf("workload,seed,fill_pct,files,failed,mib,seconds,files_per_s,mib_per_s,"
+           "p50_us,p99_us,fragmented_pct,extents_per_file,free_runs,largest_free_mib\n");
+    int rc = 0;
+    for (int i = 0; i < args.fill_count && rc == 0; i++) {
+        rc = bench_fill_level(&args, &corpus, &filler, args.fills[i]);
+    }
+    free_corpus(&corpus);
+    free_corpus(&filler);
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,376 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread bench_kernels.c -o bench_kernels
+//
+// Microbenchmarks for the hot kernels in minivsfs.h, one CSV row per case:
+//   kernel,case,bytes_per_op,ns_per_op,gb_per_s
+// bytes_per_op is the data the kernel touches per call (for the scanners, the
+// bitmap words or directory entries it actually looked at). Each case runs
+// for --min-ms, is repeated BENCH_REPEATS times and the fastest run is kept.
+#include "minivsfs.h"
+
+#define BENCH_REPEATS 3
+#define BENCH_MIN_MS 100
+#define BENCH_SEED 0x4D565346u
+
+typedef struct bench bench_t;
+typedef void (*bench_fn)(bench_t* b);
+
+struct bench {
+    const char* kernel;
+    char name[64];
+    bench_fn fn;          // one call of the kernel
+    uint64_t bytes;       // bytes touched per call
+    uint8_t* buf;
+    uint8_t* buf2;
+    size_t len;
+    uint64_t nbits;
+    fs_image_t fs;        // in-memory directory for the directory kernels
+    char (*names)[58];
+    uint64_t name_count;
+    uint64_t next;
+};
+
+volatile uint64_t g_sink;
+uint32_t g_rng = BENCH_SEED;
+uint64_t g_min_ns = BENCH_MIN_MS * 1000000ull;
+const char* g_filter;
+
+uint32_t rng_next(void) {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 17;
+    g_rng ^= g_rng << 5;
+    return g_rng;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Time b->fn and print its row. Calls are timed in batches that double until
+// one batch takes at least g_min_ns.
+void bench_run(bench_t* b) {
+    if (g_filter && !strstr(b->kernel, g_filter) && !strstr(b->name, g_filter)) {
+        return;
+    }
+    double best = 0;
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        for (uint64_t ops = 64;; ops *= 2) {
+            uint64_t t0 = now_ns();
+            for (uint64_t i = 0; i < ops; i++) {
+                b->fn(b);
+            }
+            uint64_t ns = now_ns() - t0;
+            if (ns >= g_min_ns) {
+                double per_op = (double)ns / (double)ops;
+                if (best == 0 || per_op < best) {
+                    best = per_op;
+                }
+                break;
+            }
+        }
+    }
+    printf("%s,%s,%" PRIu64 ",%.2f,%.3f\n", b->kernel, b->name, b->bytes, best, (double)b->bytes / best);
+    fflush(stdout);
+}
+
+// Bytes a scanner touches per call, measured with the statistics counters
+uint64_t bench_scanned(bench_t* b, int counter, uint64_t unit_bytes) {
+    const char* none = NULL;
+    uint64_t calls = 1024;
+    stats_enable(&none, 0);
+    for (uint64_t i = 0; i < calls; i++) {
+        b->fn(b);
+    }
+    uint64_t bytes = g_stats.counters[counter] * unit_bytes / calls;
+    g_stats.enabled = 0;
+    b->next = 0;
+    return bytes;
+}
+
+// ==================================CHECKSUMS===================================
+
+void run_crc32(bench_t* b) {
+    g_sink += crc32(b->buf, b->len);
+}
+
+void run_crc32_update(bench_t* b) {
+    g_sink += crc32_update((uint32_t)g_sink, b->buf, b->len);
+}
+
+void run_inode_crc(bench_t* b) {
+    inode_crc_finalize((inode_t*)b->buf);
+    g_sink += ((inode_t*)b->buf)->inode_crc;
+}
+
+void run_dirent_checksum(bench_t* b) {
+    dirent_checksum_finalize((dirent64_t*)b->buf);
+    g_sink += ((dirent64_t*)b->buf)->checksum;
+}
+
+void run_superblock_crc(bench_t* b) {
+    g_sink += superblock_crc_finalize((superblock_t*)b->buf);
+}
+
+void bench_checksums(uint8_t* buf) {
+    static const size_t sizes[] = {64, 4096, 1u << 20};
+    bench_t b;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        memset(&b, 0, sizeof(b));
+        b.buf = buf;
+        b.len = sizes[i];
+        b.bytes = sizes[i];
+        snprintf(b.name, sizeof(b.name), "%zuB", sizes[i]);
+        b.kernel = "crc32";
+        b.fn = run_crc32;
+        bench_run(&b);
+        b.kernel = "crc32_update";
+        b.fn = run_crc32_update;
+        bench_run(&b);
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.buf = buf;
+    b.kernel = "inode_crc_finalize";
+    b.fn = run_inode_crc;
+    b.bytes = 120;
+    snprintf(b.name, sizeof(b.name), "inode");
+    bench_run(&b);
+
+    b.kernel = "dirent_checksum_finalize";
+    b.fn = run_dirent_checksum;
+    b.bytes = 63;
+    snprintf(b.name, sizeof(b.name), "dirent");
+    bench_run(&b);
+
+    b.kernel = "superblock_crc_finalize";
+    b.fn = run_superblock_crc;
+    b.bytes = BS - 4;
+    snprintf(b.name, sizeof(b.name), "block0");
+    bench_run(&b);
+}
+
+// ===================================BITMAPS====================================
+// Claim one bit from the start of the bitmap and give it back, so the fill
+// pattern stays the same from call to call.
+
+void run_bitmap_claim(bench_t* b) {
+    uint32_t got;
+    if (bitmap_claim(b->buf, b->nbits, 0, b->nbits, &got, 1) == 1) {
+        bitmap_release(b->buf, got - 1);
+        g_sink += got;
+    }
+}
+
+void bench_bitmaps(uint8_t* buf) {
+    static const uint64_t sizes[] = {BITS_PER_BLOCK, 8u << 20}; // one bitmap block, 32 GiB of data
+    static const char* const patterns[] = {"empty", "random50", "random99", "prefix99", "full-last"};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+            uint64_t nbits = sizes[s];
+            memset(buf, 0, nbits / 8);
+            for (uint64_t i = 0; i < nbits; i++) {
+                int used = 0;
+                switch (p) {
+                case 1: used = rng_next() % 100 < 50; break;
+                case 2: used = rng_next() % 100 < 99; break;
+                case 3: used = i < nbits / 100 * 99; break;
+                case 4: used = i != nbits - 1; break;
+                }
+                if (used) {
+                    bitmap_set(buf, i);
+                }
+            }
+
+            bench_t b;
+            memset(&b, 0, sizeof(b));
+            b.kernel = "bitmap_claim";
+            b.fn = run_bitmap_claim;
+            b.buf = buf;
+            b.nbits = nbits;
+            snprintf(b.name, sizeof(b.name), "%s/%" PRIu64 "bits", patterns[p], nbits);
+            b.bytes = bench_scanned(&b, STAT_BITS_SCANNED, 1) / 8;
+            bench_run(&b);
+        }
+    }
+}
+
+// =================================DIRECTORIES==================================
+// A root directory of dir_blocks blocks filled to load, laid out the way the
+// adder leaves it: every name in its home block or the next with room.
+
+int dir_setup(bench_t* b, uint64_t dir_blocks, uint64_t load_pct) {
+    uint64_t map = map_blocks_needed(dir_blocks);
+    uint64_t total = dir_blocks + map;
+    memset(&b->fs, 0, sizeof(b->fs));
+    b->fs.data_region = calloc(total, BS);
+    b->fs.inode_table = calloc(1, sizeof(inode_t));
+    uint32_t* blocks = malloc(total * sizeof(uint32_t));
+    b->name_count = (dir_blocks * DIRENTS_PER_BLOCK - 2) * load_pct / 100;
+    b->names = malloc((b->name_count + 1) * sizeof(*b->names));
+    if (!b->fs.data_region || !b->fs.inode_table || !blocks || !b->names) {
+        free(blocks);
+        return -1;
+    }
+    for (uint64_t i = 0; i < total; i++) {
+        blocks[i] = (uint32_t)(i + 1);
+    }
+    inode_t* root = fs_inode(&b->fs, ROOT_INO);
+    root->size_bytes = dir_blocks * BS;
+    inode_set_block_map(&b->fs, root, blocks, dir_blocks, blocks + dir_blocks);
+    free(blocks);
+
+    dirent64_t* first = dir_block_entries(&b->fs, root, 0);
+    if (!first) {
+        return -1;
+    }
+    dirent_init(&first[0], ROOT_INO, 2, ".");
+    dirent_init(&first[1], ROOT_INO, 2, "..");
+    for (uint64_t i = 0; i < b->name_count; i++) {
+        snprintf(b->names[i], sizeof(b->names[i]), "file_%08" PRIx32 "_%" PRIu64, rng_next(), i);
+        dirent64_t* slot = dir_free_slot(&b->fs, root, b->names[i]);
+        if (!slot) {
+            return -1;
+        }
+        dirent_init(slot, (uint32_t)(i + 2), 1, b->names[i]);
+    }
+    return 0;
+}
+
+void dir_teardown(bench_t* b) {
+    free(b->fs.data_region);
+    free(b->fs.inode_table);
+    free(b->names);
+}
+
+// Names are visited in a scattered order: early inserts sit at the front of
+// their blocks, late ones further along the probe chain
+void run_dir_lookup_hit(bench_t* b) {
+    const char* name = b->names[b->next++ * 7919 % b->name_count];
+    g_sink += (uintptr_t)dir_lookup(&b->fs, fs_inode(&b->fs, ROOT_INO), name);
+}
+
+// The duplicate-name check of an add: a miss probes the whole chain
+void run_dir_lookup_miss(bench_t* b) {
+    char name[58];
+    snprintf(name, sizeof(name), "absent_%" PRIu64, b->next++ % 65536);
+    g_sink += (uintptr_t)dir_lookup(&b->fs, fs_inode(&b->fs, ROOT_INO), name);
+}
+
+void run_dir_free_slot(bench_t* b) {
+    char name[58];
+    snprintf(name, sizeof(name), "absent_%" PRIu64, b->next++ % 65536);
+    g_sink += (uintptr_t)dir_free_slot(&b->fs, fs_inode(&b->fs, ROOT_INO), name);
+}
+
+void bench_directories(void) {
+    static const uint64_t dir_sizes[] = {1, 64, 4096};
+    static const uint64_t loads[] = {50, 75, 95};
+    static const struct { const char* kernel; bench_fn fn; } kernels[] = {
+        {"dir_lookup_hit", run_dir_lookup_hit},
+        {"dir_lookup_miss", run_dir_lookup_miss},
+        {"dir_free_slot", run_dir_free_slot},
+    };
+    for (size_t d = 0; d < sizeof(dir_sizes) / sizeof(dir_sizes[0]); d++) {
+        for (size_t l = 0; l < sizeof(loads) / sizeof(loads[0]); l++) {
+            bench_t b;
+            memset(&b, 0, sizeof(b));
+            if (dir_setup(&b, dir_sizes[d], loads[l]) != 0) {
+                perror("Memory allocation failed");
+                dir_teardown(&b);
+                continue;
+            }
+            for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                b.kernel = kernels[k].kernel;
+                b.fn = kernels[k].fn;
+                snprintf(b.name, sizeof(b.name), "%" PRIu64 "blocks/load%" PRIu64, dir_sizes[d], loads[l]);
+                b.bytes = bench_scanned(&b, STAT_DIRENTS_SCANNED, sizeof(dirent64_t));
+                bench_run(&b);
+            }
+            dir_teardown(&b);
+        }
+    }
+}
+
+// ==================================BLOCK COPY==================================
+
+void run_block_copy(bench_t* b) {
+    memcpy(b->buf2, b->buf, b->len);
+    g_sink += b->buf2[b->len - 1];
+}
+
+void bench_block_copy(uint8_t* src, uint8_t* dst) {
+    static const uint64_t blocks[] = {1, 256};
+    for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        bench_t b;
+        memset(&b, 0, sizeof(b));
+        b.kernel = "block_copy";
+        b.fn = run_block_copy;
+        b.buf = src;
+        b.buf2 = dst;
+        b.len = blocks[i] * BS;
+        b.bytes = b.len;
+        snprintf(b.name, sizeof(b.name), "%" PRIu64 "blocks", blocks[i]);
+        bench_run(&b);
+    }
+}
+
+// ==================================ZERO CHECK==================================
+
+void run_block_is_zero(bench_t* b) {
+    g_sink += block_is_zero(b->buf);
+}
+
+// A zero block is the whole scan; a data block usually fails on the first words
+void bench_zero_check(uint8_t* data, uint8_t* zero) {
+    memset(zero, 0, BS);
+    uint8_t* cases[] = {zero, data};
+    const char* names[] = {"zero", "data"};
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        bench_t b;
+        memset(&b, 0, sizeof(b));
+        b.kernel = "block_is_zero";
+        b.fn = run_block_is_zero;
+        b.buf = cases[i];
+        b.bytes = i == 0 ? BS : 64;
+        snprintf(b.name, sizeof(b.name), "%s", names[i]);
+        bench_run(&b);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc) {
+            g_min_ns = strtoull(argv[++i], NULL, 10) * 1000000ull;
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            g_filter = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--min-ms <n>] [--filter <kernel>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    size_t buf_size = 1u << 20;
+    uint8_t* buf = aligned_alloc(BS, buf_size);
+    uint8_t* buf2 = aligned_alloc(BS, buf_size);
+    if (!buf || !buf2) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+    for (size_t i = 0; i < buf_size; i++) {
+        buf[i] = (uint8_t)rng_next();
+    }
+    memset(buf2, 0, buf_size);
+
+    printf("kernel,case,bytes_per_op,ns_per_op,gb_per_s\n");
+    bench_checksums(buf);
+    bench_block_copy(buf, buf2);
+    bench_zero_check(buf, buf2);
+    bench_bitmaps(buf);
+    bench_directories();
+
+    free(buf);
+    free(buf2);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#!/bin/sh
+# Build and fill a large MiniVSFS image (default 1 TiB, 16M inodes).
+#
+#   ./bench_scale.sh [workdir]
+#
+# Environment knobs:
+#   SIZE_KIB   image size in KiB        (default 1073741824 = 1 TiB)
+#   INODES     inode count              (default 16777216)
+#   POPULATE   files in the populated tree (default 100000)
+#   ADDS       files added one by one with mkfs_adder afterwards (default 1000)
+#   FILE_KIB   size of each generated file (default 4)
+#
+# The files hold random bytes: all-zero blocks are stored as holes, so a zero
+# corpus would fill nothing. The filled image is checked with mkfs_check at
+# the end and the script fails if it finds a problem. The image is sparse, so
+# disk usage follows the data actually written.
+set -eu
+
+WORK=${1:-./bench_scale.work}
+SIZE_KIB=${SIZE_KIB:-1073741824}
+INODES=${INODES:-16777216}
+POPULATE=${POPULATE:-100000}
+ADDS=${ADDS:-1000}
+FILE_KIB=${FILE_KIB:-4}
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+mkdir -p "$WORK/tree" "$WORK/adds"
+
+gcc -O2 -std=c17 -Wall -Wextra -pthread "$HERE/mkfs_builder_final.c" -o "$WORK/mkfs_builder"
+gcc -O2 -std=c17 -Wall -Wextra -pthread "$HERE/mkfs_adder_final.c" -o "$WORK/mkfs_adder"
+gcc -O2 -std=c17 -Wall -Wextra -pthread "$HERE/mkfs_check_final.c" -o "$WORK/mkfs_check"
+
+now_ms() { date +%s%3N; }
+
+# Source files: POPULATE files spread over 100 directories, plus ADDS loose files
+i=0
+while [ "$i" -lt "$POPULATE" ]; do
+    d="$WORK/tree/d$((i % 100))"
+    [ -d "$d" ] || mkdir -p "$d"
+    [ -f "$d/f$i" ] || head -c $((FILE_KIB * 1024)) /dev/urandom > "$d/f$i"
+    i=$((i + 1))
+done
+i=0
+while [ "$i" -lt "$ADDS" ]; do
+    [ -f "$WORK/adds/a$i" ] || head -c $((FILE_KIB * 1024)) /dev/urandom > "$WORK/adds/a$i"
+    i=$((i + 1))
+done
+
+t0=$(now_ms)
+"$WORK/mkfs_builder" --image "$WORK/empty.img" --size-kib "$SIZE_KIB" --inodes "$INODES" > /dev/null
+t1=$(now_ms)
+echo "build empty ${SIZE_KIB} KiB / ${INODES} inodes: $((t1 - t0)) ms"
+
+t0=$(now_ms)
+"$WORK/mkfs_builder" --image "$WORK/filled.img" --size-kib "$SIZE_KIB" --inodes "$INODES" \
+    --populate "$WORK/tree" > /dev/null
+t1=$(now_ms)
+echo "build populated with $POPULATE files: $((t1 - t0)) ms"
+
+t0=$(now_ms)
+i=0
+while [ "$i" -lt "$ADDS" ]; do
+    "$WORK/mkfs_adder" --input "$WORK/filled.img" --output "$WORK/filled.img" --file "$WORK/adds/a$i" > /dev/null
+    i=$((i + 1))
+done
+t1=$(now_ms)
+if [ "$ADDS" -gt 0 ]; then
+    echo "add $ADDS files: $((t1 - t0)) ms ($(( (t1 - t0) * 1000 / ADDS )) us/file)"
+fi
+
+t0=$(now_ms)
+if ! "$WORK/mkfs_check" --image "$WORK/filled.img" --jobs "$(nproc)" > "$WORK/check.txt"; then
+    cat "$WORK/check.txt"
+    echo "check: FAILED"
+    exit 1
+fi
+t1=$(now_ms)
+echo "check filled image: $((t1 - t0)) ms, $(tail -1 "$WORK/check.txt" | sed 's/^.*: //')"
+
+du -h --apparent-size "$WORK/filled.img" | sed 's/^/image size: /'
+du -h "$WORK/filled.img" | sed 's/^/disk usage: /'
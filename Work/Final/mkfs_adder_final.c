@@ -1,480 +1,2821 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_adder.c -o mkfs_adder
-#define _FILE_OFFSET_BITS 64
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <inttypes.h>
-#include <errno.h>
-#include <time.h>
-#include <assert.h>
-#include <unistd.h>
-#include <sys/stat.h>
-
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
-
-#pragma pack(push, 1)
-typedef struct
-{
-    uint32_t magic;      
-    uint32_t version;    
-    uint32_t block_size; 
-
-    uint64_t total_blocks;       
-    uint64_t inode_count;        
-    uint64_t inode_bitmap_start; 
-
-    uint64_t inode_bitmap_blocks; 
-    uint64_t data_bitmap_start;   
-    uint64_t data_bitmap_blocks;  
-    uint64_t inode_table_start;   
-
-    uint64_t inode_table_blocks; 
-    uint64_t data_region_start;  
-    uint64_t data_region_blocks; 
-    uint64_t root_inode;         
-    uint64_t mtime_epoch;        
-    uint32_t flags;
-
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint32_t checksum; // crc32(superblock[0..4091])
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push, 1)
-typedef struct
-{
-    uint16_t mode;  
-    uint16_t links; 
-
-    uint32_t uid; 
-    uint32_t gid; 
-
-    uint64_t size_bytes; 
-    uint64_t atime;      
-    uint64_t mtime;      
-    uint64_t ctime;      
-
-    uint32_t direct[DIRECT_MAX];
-    uint32_t reserved_0;         
-    uint32_t reserved_1;        
-    uint32_t reserved_2;        
-
-    uint32_t proj_id;     
-    uint32_t uid16_gid16; 
-    uint64_t xattr_ptr;   
-
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint64_t inode_crc; // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_adder_final.c -o mkfs_adder
+#include "minivsfs.h"
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DAEMON_BATCH_COUNT 256   // commit after this many adds...
+#define DAEMON_BATCH_MS 2        // ...or once the oldest uncommitted add is this old
+#define ADD_JOBS 4                // default worker threads for batch adds
+#define PIPELINE_CHUNK_BLOCKS 256u    // 1 MiB per pipeline buffer
+#define PIPELINE_SLOTS 4u             // two buffers for each stage to alternate between
+#define PIPELINE_MIN_BLOCKS 16384u    // files from 64 MiB up are copied through the pipeline
+#define DAEMON_LINE_MAX (PATH_MAX * 2 + 16)
+_Static_assert(WS_RANGE_BLOCKS % COMPRESS_CHUNK_BLOCKS == 0, "block ranges must not split a compressed chunk");
+
+// Phases timed by --stats=json; "file" is a whole add, from its first step to
+// its directory entry (commit not included). Each per-file phase records at
+// most one sample per add, so its histogram is a per-file latency - except
+// copy, which records one per block range of a file split across workers.
+enum {
+    PHASE_OPEN, PHASE_DIR_RESERVE, PHASE_HASH, PHASE_ALLOC, PHASE_COPY, PHASE_UPDATE, PHASE_PACK, PHASE_DIR_INSERT,
+    PHASE_INDEX, PHASE_COMMIT, PHASE_CLOSE, PHASE_FILE, ADD_PHASES
+};
+_Static_assert(ADD_PHASES <= STATS_MAX_PHASES, "every adder phase needs a histogram");
+static const char* const ADD_PHASE_NAMES[ADD_PHASES] = {
+    "open", "dir_reserve", "hash", "alloc", "copy", "update", "pack", "dir_insert", "index", "commit", "close", "file",
+};
+
 typedef struct {
-    uint32_t inode_no;            // inode number (0 if free)
-    uint8_t type;                 // 1=file, 2=dir
-    char name[58];                // filename (null-terminated)
-    uint8_t checksum;             // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
-    }
-}
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-// ====================================CRC32====================================
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
-}
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
-}
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
-    de->checksum = x;
-}
+    char* input_path;
+    char* output_path;
+    char** files;             // --file may be given more than once (batch mode)
+    int file_count;
+    int jobs;
+    int huge_pages;           // back the image mapping and I/O buffers with huge pages
+    int dedup;                // turn on block deduplication for the image
+    int dedup_files;          // link files whose content is already in the image
+    int compress;             // store added files as compressed chunk streams
+    int update;               // rewrite files that already exist instead of failing
+    int append;               // add the new tail of files that already exist
+    char* sync_dir;           // mirror this host directory into the image
+    int checksum;             // --sync: also compare content crc32s
+    char* daemon_socket;      // serve requests on this socket
+    char* connect_socket;     // send requests to a running daemon
+    int list;
+    char** extracts;          // --extract may be given more than once
+    int extract_count;
+    char* extract_to;
+    int batch_count;
+    int batch_ms;
+    int stats;                // print per-phase timings and counters as JSON
+} adder_args_t;
 
 void print_usage(const char* prog_name) {
-    fprintf(stderr, "Usage: %s --input <input.img> --output <output.img> --file <filename>\n", prog_name);
+    fprintf(stderr, "Usage: %s --input <input.img> --output <output.img> --file <filename> [--file <filename> ...] [--jobs <n>] [--hugepages] [--dedup] [--dedup-files] [--compress] [--update|--append] [--stats=json]\n", prog_name);
+    fprintf(stderr, "       %s --input <image.img> [--output <output.img>] --daemon <socket> [--batch-count <n>] [--batch-ms <ms>] [--hugepages] [--dedup] [--dedup-files] [--compress] [--update|--append] [--stats=json]\n", prog_name);
+    fprintf(stderr, "       %s --input <image.img> [--output <output.img>] --sync <dir> [--checksum] [--jobs <n>] [--hugepages] [--dedup] [--dedup-files] [--compress] [--stats=json]\n", prog_name);
+    fprintf(stderr, "       %s --input <image.img> --extract <name> [--extract <name> ...] --to <path|dir> [--jobs <n>] [--stats=json]\n", prog_name);
+    fprintf(stderr, "       %s --connect <socket> (--file <filename> ... | --list | --extract <name> ... --to <path|dir> | --stats=json)\n", prog_name);
 }
 
-int parse_args(int argc, char* argv[], char** input_path, char** output_path, char** file_path) {
-    if (argc != 7) {
+int parse_args(int argc, char* argv[], adder_args_t* args) {
+    memset(args, 0, sizeof(*args));
+    args->batch_count = DAEMON_BATCH_COUNT;
+    args->batch_ms = DAEMON_BATCH_MS;
+    args->jobs = ADD_JOBS;
+    args->files = calloc((size_t)argc, sizeof(char*));
+    args->extracts = calloc((size_t)argc, sizeof(char*));
+    if (!args->files || !args->extracts) {
         return -1;
     }
-    
-    for (int i = 1; i < argc; i += 2) {
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--list") == 0) {
+            args->list = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--hugepages") == 0) {
+            args->huge_pages = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--dedup") == 0) {
+            args->dedup = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--dedup-files") == 0) {
+            args->dedup_files = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--compress") == 0) {
+            args->compress = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--update") == 0) {
+            args->update = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--append") == 0) {
+            args->append = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--checksum") == 0) {
+            args->checksum = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--stats=json") == 0) {
+            args->stats = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return -1;
+        }
         if (strcmp(argv[i], "--input") == 0) {
-            *input_path = argv[i + 1];
+            args->input_path = argv[++i];
         } else if (strcmp(argv[i], "--output") == 0) {
-            *output_path = argv[i + 1];
+            args->output_path = argv[++i];
         } else if (strcmp(argv[i], "--file") == 0) {
-            *file_path = argv[i + 1];
+            args->files[args->file_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            args->daemon_socket = argv[++i];
+        } else if (strcmp(argv[i], "--connect") == 0) {
+            args->connect_socket = argv[++i];
+        } else if (strcmp(argv[i], "--extract") == 0) {
+            args->extracts[args->extract_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--sync") == 0) {
+            args->sync_dir = argv[++i];
+        } else if (strcmp(argv[i], "--to") == 0) {
+            args->extract_to = argv[++i];
+        } else if (strcmp(argv[i], "--batch-count") == 0) {
+            args->batch_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            args->jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--batch-ms") == 0) {
+            args->batch_ms = atoi(argv[++i]);
         } else {
             return -1;
         }
     }
-    
-    if (!*input_path || !*output_path || !*file_path) {
+
+    if (args->connect_socket) {
+        // --stats=json asks the daemon for its statistics
+        int requests = (args->file_count > 0) + args->list + (args->extract_count > 0) + args->stats;
+        return (requests == 1 && !args->dedup && !args->dedup_files && !args->compress && !args->update && !args->append && !args->sync_dir && !args->checksum && (args->extract_count == 0 || args->extract_to)) ? 0 : -1;
+    }
+    if (!args->input_path || args->batch_count < 1 || args->batch_ms < 0 || args->jobs < 1 ||
+        (args->update && args->append)) {
+        return -1;
+    }
+    if (args->sync_dir || args->checksum) {
+        return args->sync_dir && !args->daemon_socket && args->file_count == 0 && args->extract_count == 0 &&
+                       !args->update && !args->append
+                   ? 0
+                   : -1;
+    }
+    if (args->daemon_socket) {
+        return args->file_count == 0 && args->extract_count == 0 ? 0 : -1;
+    }
+    if (args->extract_count > 0) {
+        return args->file_count == 0 && args->extract_to && !args->dedup && !args->dedup_files && !args->compress &&
+                       !args->update && !args->append
+                   ? 0
+                   : -1;
+    }
+    if (!args->output_path || args->file_count == 0) {
         return -1;
     }
     
     return 0;
 }
 
-// Find the first free inode in the bitmap
-uint32_t find_free_inode(uint8_t* inode_bitmap, uint64_t inode_count) {
-    for (uint64_t i = 0; i < inode_count; i++) {
-        uint64_t byte_idx = i / 8;
-        uint8_t bit_idx = i % 8;
-        
-        if (!(inode_bitmap[byte_idx] & (1 << bit_idx))) {
-            return i + 1; // inodes are 1-indexed
+// ==================================INGEST=====================================
+// Adds run inside an ingest session that may be shared by several threads.
+// Data is written straight into the mapped image, and the directory entry is
+// inserted last, so a file only becomes visible once it is complete. Bitmap
+// allocation is lock-free (see fs_alloc_blocks); the directory is locked:
+//   dir_lock       shared by inserts, exclusive while the root directory grows
+//   bucket_locks   by home block of a name: one insert of a given name at a time
+//   block_locks    by directory block: contents of that block (never nested)
+// Root inode links/mtime and the superblock are updated once, at commit.
+// On an image with SB_FLAG_DEDUP every add looks its blocks up in the hash
+// index and shares identical ones instead of writing them again.
+
+#define INGEST_LOCKS 64
+#define FILE_INDEX_MIN 1024u     // initial slots of the --dedup-files tables
+
+// Whole-file dedup (--dedup-files): the files added in this session, by size
+// and content hash. Sizes are also kept on their own so that a file whose size
+// was never seen is not read twice; its hash is taken from the image after the
+// copy instead.
+typedef struct {
+    uint64_t size;
+    uint64_t hash[2];
+    uint32_t inode_no;        // 0 if the slot is empty
+} file_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;     // the tables, and links of the inodes they name
+    file_entry_t* entries;
+    uint64_t entry_cap;       // a power of two, or 0 before the first add
+    uint64_t entry_count;
+    uint64_t* sizes;          // size + 1, 0 if the slot is empty
+    uint64_t size_cap;
+    uint64_t size_count;
+} file_index_t;
+
+uint64_t file_index_slot(uint64_t size, const uint64_t hash[2], uint64_t cap) {
+    return fmix64(size ^ hash[0] ^ rotl64(hash[1], 32)) & (cap - 1);
+}
+
+// Callers hold lock
+int file_index_has_size(const file_index_t* ix, uint64_t size) {
+    if (ix->size_cap == 0) {
+        return 0;
+    }
+    for (uint64_t i = fmix64(size) & (ix->size_cap - 1);; i = (i + 1) & (ix->size_cap - 1)) {
+        if (ix->sizes[i] == 0) {
+            return 0;
+        }
+        if (ix->sizes[i] == size + 1) {
+            return 1;
         }
     }
-    return 0; // no free inode found
 }
 
-// Find the first free data block in the bitmap
-uint32_t find_free_data_block(uint8_t* data_bitmap, uint64_t data_block_count) {
-    for (uint64_t i = 0; i < data_block_count; i++) {
-        uint64_t byte_idx = i / 8;
-        uint8_t bit_idx = i % 8;
-        
-        if (!(data_bitmap[byte_idx] & (1 << bit_idx))) {
-            return i + 1; // return relative to data region (1-indexed)
+uint32_t file_index_find(const file_index_t* ix, uint64_t size, const uint64_t hash[2]) {
+    if (ix->entry_cap == 0) {
+        return 0;
+    }
+    for (uint64_t i = file_index_slot(size, hash, ix->entry_cap);; i = (i + 1) & (ix->entry_cap - 1)) {
+        const file_entry_t* e = &ix->entries[i];
+        if (e->inode_no == 0) {
+            return 0;
+        }
+        if (e->size == size && e->hash[0] == hash[0] && e->hash[1] == hash[1]) {
+            return e->inode_no;
         }
     }
-    return 0; // no free data block found
 }
 
-// Set a bit in the bitmap
-void set_bitmap_bit(uint8_t* bitmap, uint32_t bit_num) {
-    uint32_t byte_idx = (bit_num - 1) / 8; // adjust for 1-indexing
-    uint8_t bit_idx = (bit_num - 1) % 8;
-    bitmap[byte_idx] |= (1 << bit_idx);
+// Rebuild both tables at twice the size once either would pass 3/4 full
+int file_index_grow(file_index_t* ix) {
+    if ((ix->entry_count + 1) * DIR_LOAD_DEN > ix->entry_cap * DIR_LOAD_NUM) {
+        uint64_t cap = ix->entry_cap ? ix->entry_cap * 2 : FILE_INDEX_MIN;
+        file_entry_t* entries = calloc(cap, sizeof(file_entry_t));
+        if (!entries) {
+            return -1;
+        }
+        for (uint64_t i = 0; i < ix->entry_cap; i++) {
+            const file_entry_t* e = &ix->entries[i];
+            if (e->inode_no != 0) {
+                uint64_t j = file_index_slot(e->size, e->hash, cap);
+                while (entries[j].inode_no != 0) {
+                    j = (j + 1) & (cap - 1);
+                }
+                entries[j] = *e;
+            }
+        }
+        free(ix->entries);
+        ix->entries = entries;
+        ix->entry_cap = cap;
+    }
+    if ((ix->size_count + 1) * DIR_LOAD_DEN > ix->size_cap * DIR_LOAD_NUM) {
+        uint64_t cap = ix->size_cap ? ix->size_cap * 2 : FILE_INDEX_MIN;
+        uint64_t* sizes = calloc(cap, sizeof(uint64_t));
+        if (!sizes) {
+            return -1;
+        }
+        for (uint64_t i = 0; i < ix->size_cap; i++) {
+            if (ix->sizes[i] != 0) {
+                uint64_t j = fmix64(ix->sizes[i] - 1) & (cap - 1);
+                while (sizes[j] != 0) {
+                    j = (j + 1) & (cap - 1);
+                }
+                sizes[j] = ix->sizes[i];
+            }
+        }
+        free(ix->sizes);
+        ix->sizes = sizes;
+        ix->size_cap = cap;
+    }
+    return 0;
 }
 
-// Find free directory entry in root directory
-int find_free_dirent(dirent64_t* entries, int max_entries) {
-    for (int i = 2; i < max_entries; i++) { // skip . and .. entries
-        if (entries[i].inode_no == 0) {
-            return i;
+// Remember an added file; running out of memory only costs future links
+void file_index_add(file_index_t* ix, uint64_t size, const uint64_t hash[2], uint32_t inode_no) {
+    pthread_mutex_lock(&ix->lock);
+    if (file_index_grow(ix) == 0 && file_index_find(ix, size, hash) == 0) {
+        uint64_t i = file_index_slot(size, hash, ix->entry_cap);
+        while (ix->entries[i].inode_no != 0) {
+            i = (i + 1) & (ix->entry_cap - 1);
+        }
+        ix->entries[i] = (file_entry_t){ .size = size, .hash = { hash[0], hash[1] }, .inode_no = inode_no };
+        ix->entry_count++;
+        if (!file_index_has_size(ix, size)) {
+            uint64_t j = fmix64(size) & (ix->size_cap - 1);
+            while (ix->sizes[j] != 0) {
+                j = (j + 1) & (ix->size_cap - 1);
+            }
+            ix->sizes[j] = size + 1;
+            ix->size_count++;
         }
     }
-    return -1; // no free entry found
+    pthread_mutex_unlock(&ix->lock);
 }
 
-int add_file_to_filesystem(const char* input_path, const char* output_path, const char* file_path) {
-    struct stat st;
-    if (stat(file_path, &st) != 0) {
-        perror("Cannot access file to add");
-        return -1;
+// Content hash of a whole file: the block hashes folded in order. Blocks are
+// zero-padded, so the size is part of the key as well.
+void file_hash_block(uint64_t acc[2], const uint8_t* block) {
+    uint64_t h[2];
+    dedup_hash(block, h);
+    acc[0] = fmix64(rotl64(acc[0], 17) ^ h[0]);
+    acc[1] = fmix64(rotl64(acc[1], 29) ^ h[1]);
+}
+
+typedef struct {
+    fs_image_t* fs;
+    pthread_rwlock_t dir_lock;
+    pthread_mutex_t bucket_locks[INGEST_LOCKS];
+    pthread_mutex_t block_locks[INGEST_LOCKS];
+    uint64_t root_entries;    // reserved root entries (atomic; written back at commit)
+    uint64_t added;           // files added since the last commit (atomic)
+    arena_t arena;            // per-add metadata (block lists), reset at commit
+    bufpool_t buffers;        // pipeline buffers, reused across adds
+    int dedup;                // the image has SB_FLAG_DEDUP
+    int dedup_files;          // --dedup-files: link identical files
+    file_index_t files;
+    int compress;             // --compress: store files as compressed chunk streams
+    int update;               // --update: rewrite the changed blocks of existing files
+    int append;               // --append: add what follows the stored end of existing files
+} ingest_t;
+
+void ingest_init(ingest_t* ing, fs_image_t* fs, int huge_pages) {
+    ing->fs = fs;
+    arena_init(&ing->arena);
+    bufpool_init(&ing->buffers, PIPELINE_CHUNK_BLOCKS * BS, huge_pages);
+    pthread_rwlock_init(&ing->dir_lock, NULL);
+    for (int i = 0; i < INGEST_LOCKS; i++) {
+        pthread_mutex_init(&ing->bucket_locks[i], NULL);
+        pthread_mutex_init(&ing->block_locks[i], NULL);
     }
+    ing->root_entries = fs->ext->root_entries;
+    ing->added = 0;
+    ing->dedup = (fs->sb->flags & SB_FLAG_DEDUP) != 0;
+    ing->dedup_files = 0;
+    ing->compress = 0;
+    ing->update = 0;
+    ing->append = 0;
+    memset(&ing->files, 0, sizeof(ing->files));
+    pthread_mutex_init(&ing->files.lock, NULL);
+}
 
-    if (!S_ISREG(st.st_mode)) {
-        perror("File to add is not a regular file");
-        return -1;
+void ingest_destroy(ingest_t* ing) {
+    arena_destroy(&ing->arena);
+    bufpool_destroy(&ing->buffers);
+    free(ing->files.entries);
+    free(ing->files.sizes);
+    pthread_mutex_destroy(&ing->files.lock);
+    pthread_rwlock_destroy(&ing->dir_lock);
+    for (int i = 0; i < INGEST_LOCKS; i++) {
+        pthread_mutex_destroy(&ing->bucket_locks[i]);
+        pthread_mutex_destroy(&ing->block_locks[i]);
     }
+}
 
-    if ((uint64_t)st.st_size > DIRECT_MAX * BS) {
-        perror("File too large to add (exceeds direct block limit)");
-        return -1;
+// Update the root inode and superblock for everything added so far, and
+// recycle the session arena. Callers must not have adds in flight.
+void ingest_commit(ingest_t* ing) {
+    uint64_t t0 = stats_now();
+    fs_image_t* fs = ing->fs;
+    inode_t* root = fs_inode(fs, ROOT_INO);
+    time_t now = time(NULL);
+
+    fs->ext->root_entries = ing->root_entries;
+    if (ing->added > 0) {
+        uint64_t links = root->links + ing->added;
+        root->links = links < UINT16_MAX ? (uint16_t)links : UINT16_MAX;
+        root->mtime = (uint64_t)now;
+        inode_checksum(root);
+        ing->added = 0;
+    }
+    fs_commit(fs, now);
+    arena_reset(&ing->arena);
+    stats_phase_end(PHASE_COMMIT, t0);
+}
+
+// Reserve a root directory entry, growing the directory first if the
+// reservation would take it past its load limit. Reserved entries count
+// towards every later growth, so the insert at the end of an add always fits.
+int ingest_dir_reserve(ingest_t* ing) {
+    inode_t* root = fs_inode(ing->fs, ROOT_INO);
+    for (;;) {
+        pthread_rwlock_rdlock(&ing->dir_lock);
+        uint64_t entries = __atomic_add_fetch(&ing->root_entries, 1, __ATOMIC_RELAXED);
+        int fits = dir_blocks_for(entries + 2) <= root->size_bytes / BS; // . and .. included
+        if (!fits) {
+            __atomic_sub_fetch(&ing->root_entries, 1, __ATOMIC_RELAXED);
+        }
+        pthread_rwlock_unlock(&ing->dir_lock);
+        if (fits) {
+            return 0;
+        }
+
+        pthread_rwlock_wrlock(&ing->dir_lock);
+        ing->fs->ext->root_entries = ing->root_entries;
+        int rc = root_dir_reserve(ing->fs);
+        pthread_rwlock_unlock(&ing->dir_lock);
+        if (rc != 0) {
+            return -1;
+        }
+    }
+}
+
+void ingest_dir_unreserve(ingest_t* ing) {
+    __atomic_sub_fetch(&ing->root_entries, 1, __ATOMIC_RELAXED);
+}
+
+// Look name up in the root directory and, if it is absent and inode_no is not
+// 0, insert it. Returns 1 if the name exists, 0 if absent (or inserted), -1 if
+// the directory is full.
+int ingest_dir_insert(ingest_t* ing, const char* name, uint32_t inode_no) {
+    const fs_image_t* fs = ing->fs;
+    const inode_t* root = fs_inode(fs, ROOT_INO);
+    int rc = 0;
+    uint64_t scanned = 0;
+
+    pthread_rwlock_rdlock(&ing->dir_lock);
+    uint64_t dir_blocks = root->size_bytes / BS;
+    uint64_t home = dir_hash(name) % dir_blocks;
+    pthread_mutex_t* bucket = &ing->bucket_locks[home % INGEST_LOCKS];
+    pthread_mutex_lock(bucket);
+
+    // Probe the whole chain for the name first, so a tombstone early in the
+    // chain is not reused while the name still lives further along
+    for (uint64_t step = 0; step < dir_blocks; step++) {
+        uint64_t b = (home + step) % dir_blocks;
+        dirent64_t* entries = dir_block_entries(fs, root, b);
+        int has_unused = 0;
+        pthread_mutex_lock(&ing->block_locks[b % INGEST_LOCKS]);
+        for (uint32_t i = (b == 0 ? 2 : 0); entries && i < DIRENTS_PER_BLOCK; i++) {
+            scanned++;
+            if (entries[i].inode_no != 0 && strcmp(entries[i].name, name) == 0) {
+                rc = 1;
+                break;
+            }
+            has_unused |= dirent_never_used(&entries[i]);
+        }
+        pthread_mutex_unlock(&ing->block_locks[b % INGEST_LOCKS]);
+        if (rc != 0 || has_unused || !entries) {
+            break;
+        }
     }
 
+    // Other names may be filling slots concurrently, so claim under the block lock
+    if (rc == 0 && inode_no != 0) {
+        rc = -1;
+        for (uint64_t step = 0; step < dir_blocks && rc != 0; step++) {
+            uint64_t b = (home + step) % dir_blocks;
+            dirent64_t* entries = dir_block_entries(fs, root, b);
+            pthread_mutex_lock(&ing->block_locks[b % INGEST_LOCKS]);
+            for (uint32_t i = (b == 0 ? 2 : 0); entries && i < DIRENTS_PER_BLOCK; i++) {
+                scanned++;
+                if (entries[i].inode_no == 0) {
+                    dirent_init(&entries[i], inode_no, 1, name); // file
+                    rc = 0;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&ing->block_locks[b % INGEST_LOCKS]);
+        }
+    }
+
+    pthread_mutex_unlock(bucket);
+    pthread_rwlock_unlock(&ing->dir_lock);
+    stats_add(STAT_DIRENTS_SCANNED, scanned);
+    return rc;
+}
 
-    FILE* input_file = fopen(input_path, "rb");
-        if (input_file == NULL) {
-            perror("Cannot open input image file");
+// Inode a name in the root directory refers to, or 0
+uint32_t ingest_dir_find(ingest_t* ing, const char* name) {
+    const inode_t* root = fs_inode(ing->fs, ROOT_INO);
+    pthread_rwlock_rdlock(&ing->dir_lock);
+    pthread_mutex_t* bucket = &ing->bucket_locks[dir_hash(name) % (root->size_bytes / BS) % INGEST_LOCKS];
+    pthread_mutex_lock(bucket);
+    const dirent64_t* de = dir_lookup(ing->fs, root, name);
+    uint32_t inode_no = de ? de->inode_no : 0;
+    pthread_mutex_unlock(bucket);
+    pthread_rwlock_unlock(&ing->dir_lock);
+    return inode_no;
+}
+
+// Read len bytes at offset, short reads retried
+int read_chunk(int fd, uint8_t* buf, uint64_t offset, uint64_t len) {
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, (off_t)(offset + done));
+        if (n <= 0) {
             return -1;
+        }
+        done += (uint64_t)n;
     }
-    
-    // Read and validate superblock
-    superblock_t superblock;
-    if (fread(&superblock, sizeof(superblock_t), 1, input_file) != 1) {
-        perror("Failed to read superblock");
-        fclose(input_file);
-        return -1;
+    stats_add(STAT_BYTES_READ, len);
+    return 0;
+}
+
+// Give back the data block of file block i if what was read is all zeros,
+// leaving a hole
+void add_drop_zero_block(fs_image_t* fs, uint32_t* blocks, uint64_t i, const uint8_t* data) {
+    if (block_is_zero(data)) {
+        fs_free_block(fs, blocks[i]);
+        blocks[i] = 0;
     }
-    
-    if (superblock.magic != 0x4D565346) {
-        perror("Invalid filesystem magic number");
-        fclose(input_file);
+}
+
+// Read file blocks [first, first + count) into their data blocks, one pread
+// per contiguous run. Holes are skipped, and blocks that turn out to be all
+// zeros become holes.
+int read_into_blocks(fs_image_t* fs, int fd, uint32_t* blocks, uint64_t first, uint64_t count, uint64_t size) {
+    uint64_t i = first;
+    while (i < first + count) {
+        if (blocks[i] == 0) {
+            i++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (i + run < first + count && blocks[i + run] == blocks[i] + run) {
+            run++;
+        }
+        uint64_t offset = i * BS;
+        uint64_t len = run * BS;
+        if (offset + len > size) {
+            len = size - offset;
+            memset(fs_block(fs, blocks[i]) + len, 0, run * BS - len); // clear the tail
+        }
+        uint8_t* dst = fs_block(fs, blocks[i]);
+        uint64_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(fd, dst + done, len - done, (off_t)(offset + done));
+            if (n <= 0) {
+                return -1;
+            }
+            done += (uint64_t)n;
+        }
+        stats_add(STAT_BYTES_READ, len);
+        stats_add(STAT_BYTES_WRITTEN, run * BS);
+        for (uint64_t k = i; k < i + run; k++) {
+            add_drop_zero_block(fs, blocks, k, dst + (k - i) * BS);
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// One file being added. An add is split in three so that the copy of a large
+// file can run as several block-range tasks: add_begin checks the file,
+// reserves its directory entry and allocates; add_copy reads a range of its
+// blocks; add_finish writes the inode and directory entry, or undoes
+// everything if any step failed.
+typedef struct {
+    ingest_t* ing;
+    const char* path;
+    const char* filename;
+    int fd;
+    uint64_t size;
+    uint64_t data_blocks;
+    uint64_t map_blocks;
+    uint32_t* blocks;         // data blocks, then the pointer blocks mapping them
+    uint32_t inode_no;
+    uint64_t ranges_left;     // block-range copies still running (atomic)
+    int failed;               // set once by the first step that fails (atomic)
+    const char* err;          // what failed, with the errno it failed with
+    int err_no;
+    uint32_t data_crc;        // crc32 of the file data, from the pipelined copy...
+    int has_crc;              // ...if it ran to the end: stored in the inode
+    uint64_t shared;          // data blocks shared with identical stored ones (atomic)
+    int linked;               // inode_no is an earlier file with the same content
+    uint64_t holes;           // file blocks stored as holes
+    int compressed;           // blocks hold a compressed chunk stream
+    uint32_t* chunk_len;      // compressed: stream bytes of each chunk
+    int updated;              // --update/--append: inode_no is the existing file, changed in place
+    uint64_t rewritten;       // updated: file blocks that changed
+    uint64_t appended;        // --append: bytes added to the end of the file
+    uint64_t started;         // stats_now() when the add began
+} add_job_t;
+
+void add_fail(add_job_t* job, const char* err, int err_no) {
+    if (!__atomic_exchange_n(&job->failed, 1, __ATOMIC_ACQ_REL)) {
+        job->err = err;
+        job->err_no = err_no;
+    }
+}
+
+void add_job_init(add_job_t* job, ingest_t* ing, const char* file_path) {
+    memset(job, 0, sizeof(*job));
+    job->ing = ing;
+    job->path = file_path;
+    job->fd = -1;
+}
+
+// --dedup-files: if a file added earlier in the session has the same size and
+// content, take a link to its inode instead. Returns that inode, or 0. Only
+// files whose size has been seen are read here.
+uint32_t add_find_identical(add_job_t* job) {
+    // file data, then what the image holds, then inode_read scratch
+    const uint64_t step = (PIPELINE_CHUNK_BLOCKS * BS - INODE_READ_SCRATCH_BYTES) / 2;
+    ingest_t* ing = job->ing;
+    fs_image_t* fs = ing->fs;
+
+    pthread_mutex_lock(&ing->files.lock);
+    int seen = file_index_has_size(&ing->files, job->size);
+    pthread_mutex_unlock(&ing->files.lock);
+    uint8_t* buf = seen ? bufpool_get(&ing->buffers) : NULL;
+    if (!buf) {
+        return 0;
+    }
+
+    // Hash the file, then compare it byte for byte with the candidate
+    uint64_t hash[2] = { 0, 0 };
+    uint32_t inode_no = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        const inode_t* ino = pass ? fs_inode(fs, inode_no) : NULL;
+        for (uint64_t off = 0; off < job->size; off += step) {
+            uint64_t len = job->size - off < step ? job->size - off : step;
+            if (read_chunk(job->fd, buf, off, len) != 0 ||
+                (pass && (inode_read(fs, ino, off, buf + step, len, buf + 2 * step) != 0 ||
+                          memcmp(buf, buf + step, len) != 0))) {
+                bufpool_put(&ing->buffers, buf);
+                return 0;
+            }
+            memset(buf + len, 0, (BS - len % BS) % BS);
+            for (uint64_t b = 0; !pass && b * BS < len; b++) {
+                file_hash_block(hash, buf + b * BS);
+            }
+        }
+        if (!pass) {
+            pthread_mutex_lock(&ing->files.lock);
+            inode_no = file_index_find(&ing->files, job->size, hash);
+            pthread_mutex_unlock(&ing->files.lock);
+            if (inode_no == 0) {
+                break;
+            }
+        }
+    }
+    bufpool_put(&ing->buffers, buf);
+
+    if (inode_no != 0) {
+        pthread_mutex_lock(&ing->files.lock);
+        inode_t* ino = fs_inode(fs, inode_no);
+        if (ino->links < UINT16_MAX) {
+            ino->links++;
+            inode_checksum(ino);
+        } else {
+            inode_no = 0;
+        }
+        pthread_mutex_unlock(&ing->files.lock);
+    }
+    return inode_no;
+}
+
+// Mark the file blocks that hold data in the source (1) and the ones in its
+// holes (0), from SEEK_DATA/SEEK_HOLE. Returns the number of data blocks.
+uint64_t add_find_data_blocks(add_job_t* job) {
+    uint64_t data = 0;
+    uint64_t off = 0;
+    memset(job->blocks, 0, job->data_blocks * sizeof(uint32_t));
+    while (off < job->size) {
+        off_t start = lseek(job->fd, (off_t)off, SEEK_DATA);
+        off_t end = (off_t)job->size;
+        if (start < 0 && errno == ENXIO) {
+            break; // a hole up to the end of the file
+        }
+        if (start < 0) {
+            start = (off_t)off; // holes not reported: everything is data
+        } else if ((end = lseek(job->fd, start, SEEK_HOLE)) < 0 || (uint64_t)end > job->size) {
+            end = (off_t)job->size;
+        }
+        if (end <= start) {
+            break;
+        }
+        for (uint64_t b = (uint64_t)start / BS; b * BS < (uint64_t)end; b++) {
+            data += job->blocks[b] == 0;
+            job->blocks[b] = 1;
+        }
+        off = (uint64_t)end;
+    }
+    return data;
+}
+
+// Allocate the data blocks of a file, then its pointer blocks. Source holes
+// get no data block, and no pointer block if they span one.
+int add_alloc_blocks(add_job_t* job) {
+    fs_image_t* fs = job->ing->fs;
+    uint64_t data = job->compressed ? job->data_blocks : add_find_data_blocks(job);
+    if (data == job->data_blocks) {
+        return fs_alloc_blocks(fs, job->blocks, job->data_blocks + job->map_blocks);
+    }
+
+    job->map_blocks = map_blocks_needed_sparse(job->blocks, job->data_blocks);
+    uint32_t* got = arena_alloc(&job->ing->arena, (data + job->map_blocks + 1) * sizeof(uint32_t));
+    if (!got || fs_alloc_blocks(fs, got, data + job->map_blocks) != 0) {
+        memset(job->blocks, 0, job->data_blocks * sizeof(uint32_t)); // nothing to free
+        job->map_blocks = 0;
         return -1;
     }
+    uint64_t k = 0;
+    for (uint64_t i = 0; i < job->data_blocks; i++) {
+        if (job->blocks[i] != 0) {
+            job->blocks[i] = got[k++];
+        }
+    }
+    memcpy(job->blocks + job->data_blocks, got + data, job->map_blocks * sizeof(uint32_t));
+    return 0;
+}
+
+// Store a non-zero file block in a block of its own: on a dedup image one
+// with the same bytes is shared through the index, else a fresh one is
+// allocated. Returns -1 if no block is free.
+int update_new_block(add_job_t* job, const uint8_t* data, uint32_t* out) {
+    fs_image_t* fs = job->ing->fs;
+    uint64_t hash[2];
+    uint32_t blk = 0;
+    if (job->ing->dedup) {
+        dedup_hash(data, hash);
+        blk = dedup_share(fs, hash, data);
+        stats_add(STAT_BLOCKS_DEDUPED, blk != 0);
+    }
+    if (blk == 0) {
+        if (fs_alloc_blocks(fs, &blk, 1) != 0) {
+            return -1;
+        }
+        memcpy(fs_block(fs, blk), data, BS);
+        stats_add(STAT_BYTES_WRITTEN, BS);
+        if (job->ing->dedup) {
+            dedup_insert(fs, hash, blk);
+        }
+    }
+    *out = blk;
+    return 0;
+}
+
+// Store one changed file block of an append at logical block idx, where the
+// file had old (0 for a hole). Unshared blocks are overwritten in place; on a
+// dedup image the block is looked up in the index like any added block.
+int update_store_block(add_job_t* job, inode_t* ino, uint64_t idx, uint32_t old, const uint8_t* data) {
+    fs_image_t* fs = job->ing->fs;
+    if (block_is_zero(data)) {
+        fs_release_block(fs, old); // becomes a hole
+        return inode_map_block(fs, ino, idx, 0);
+    }
+    if (old != 0 && !job->ing->dedup) {
+        memcpy(fs_block(fs, old), data, BS);
+        stats_add(STAT_BYTES_WRITTEN, BS);
+        return 0;
+    }
 
-    // Calculate blocks needed for the file
-    uint64_t blocks_needed = (st.st_size + BS - 1) / BS; // ceiling division
-    if (blocks_needed > DIRECT_MAX) {
-        perror("File too large to add (exceeds direct block limit)");
-        fclose(input_file);
+    uint32_t blk;
+    if (update_new_block(job, data, &blk) != 0) {
         return -1;
     }
-    
-    // Read entire image into memory for easier manipulation
-    fseek(input_file, 0, SEEK_END);
-    long img_size = ftell(input_file);
-    fseek(input_file, 0, SEEK_SET);
-    
-    uint8_t* img_data = malloc(img_size);
-    if (!img_data) {
-        perror("Memory allocation failed for image data");
-        fclose(input_file);
+    if (inode_map_block(fs, ino, idx, blk) != 0) {
+        fs_release_block(fs, blk);
         return -1;
     }
-    
-    if (fread(img_data, 1, img_size, input_file) != (size_t)img_size) {
-        perror("Failed to read image data");
-        free(img_data);
-        fclose(input_file);
+    if (old != 0) {
+        fs_release_block(fs, old);
+    }
+    return 0;
+}
+
+// Release the data blocks under the pointer block blk (depth levels above the
+// data, first mapping logical block base) that map[0..kept) no longer points
+// at the same index, then the pointer block itself
+void update_release_tree(fs_image_t* fs, uint32_t blk, int depth, uint64_t base, const uint32_t* map,
+                         uint64_t kept) {
+    if (blk == 0) {
+        return;
+    }
+    uint64_t span = 1; // data blocks under one pointer of this block
+    for (int d = 1; d < depth; d++) {
+        span *= PTRS_PER_BLOCK;
+    }
+    const uint32_t* ptrs = (const uint32_t*)fs_block(fs, blk);
+    for (uint32_t k = 0; k < PTRS_PER_BLOCK; k++) {
+        uint64_t idx = base + k * span;
+        if (depth > 1) {
+            update_release_tree(fs, ptrs[k], depth - 1, idx, map, kept);
+        } else if (ptrs[k] != 0 && !(idx < kept && map[idx] == ptrs[k])) {
+            fs_release_block(fs, ptrs[k]);
+        }
+    }
+    fs_free_block(fs, blk);
+}
+
+// Release every block of a replaced block map except the data blocks the new
+// map keeps at the same index (map[0..kept))
+void update_release_old(fs_image_t* fs, const inode_t* old, const uint32_t* map, uint64_t kept) {
+    for (uint64_t i = 0; i < DIRECT_MAX; i++) {
+        if (old->direct[i] != 0 && !(i < kept && map[i] == old->direct[i])) {
+            fs_release_block(fs, old->direct[i]);
+        }
+    }
+    uint32_t top[3] = { old->indirect, old->double_indirect, old->triple_indirect };
+    uint64_t base = DIRECT_MAX;
+    uint64_t span = 1;
+    for (int depth = 1; depth <= 3; depth++) {
+        span *= PTRS_PER_BLOCK;
+        update_release_tree(fs, top[depth - 1], depth, base, map, kept);
+        base += span;
+    }
+}
+
+// A file changed in place must be a regular file with no other names
+// (changing it would change them too)
+int update_check_inode(add_job_t* job, const inode_t* ino) {
+    if ((ino->mode & 0170000) != 0100000) {
+        add_fail(job, "Cannot update a directory", EISDIR);
+        return -1;
+    }
+    if (ino->links > 1) {
+        add_fail(job, "Cannot update a file linked from other names", EMLINK);
         return -1;
     }
-    fclose(input_file);
+    return 0;
+}
 
-    // Get pointers to different sections
-    superblock_t* sb = (superblock_t*)img_data;
-    uint8_t* inode_bitmap = img_data + (sb->inode_bitmap_start * BS);
-    uint8_t* data_bitmap = img_data + (sb->data_bitmap_start * BS);
-    inode_t* inode_table = (inode_t*)(img_data + (sb->inode_table_start * BS));
-    uint8_t* data_region = img_data + (sb->data_region_start * BS);
-    
-    // Find free inode
-    uint32_t free_inode = find_free_inode(inode_bitmap, sb->inode_count);
-    if (free_inode == 0) {
-        perror("No free inode available");
-        free(img_data);
+// --update of a file that is already in the image: compare the source with
+// the stored blocks and write the blocks that differ into new blocks, then
+// point the inode at a new block map and only then release what the old map
+// alone held. Until that switch the stored file is untouched, so a failed (or
+// interrupted) update leaves the old content. Cost is one read of the source
+// plus the changed blocks and the pointer blocks. A compressed file is
+// rewritten in full and stored raw.
+int add_update(add_job_t* job, uint32_t inode_no) {
+    fs_image_t* fs = job->ing->fs;
+    inode_t* ino = fs_inode(fs, inode_no);
+    if (update_check_inode(job, ino) != 0) {
+        return -1;
+    }
+    // A compressed file's blocks hold its stream, never a file block to keep
+    uint64_t old_blocks = ino->flags & INODE_FLAG_COMPRESSED ? 0 : (ino->size_bytes + BS - 1) / BS;
+    uint64_t new_blocks = (job->size + BS - 1) / BS;
+    uint32_t* map = arena_alloc(&job->ing->arena, (new_blocks + 1) * sizeof(uint32_t));
+    uint8_t* buf = bufpool_get(&job->ing->buffers);
+    if (!map || !buf) {
+        bufpool_put(&job->ing->buffers, buf);
+        add_fail(job, "Memory allocation failed", ENOMEM);
         return -1;
     }
 
-    // Find free data blocks
-    uint32_t free_data_blocks[DIRECT_MAX];
-    uint32_t found_blocks = 0;
-    
-    for (uint64_t i = 0; i < sb->data_region_blocks && found_blocks < blocks_needed; i++) {
-        uint64_t byte_idx = i / 8;
-        uint8_t bit_idx = i % 8;
-        
-        if (!(data_bitmap[byte_idx] & (1 << bit_idx))) {
-            free_data_blocks[found_blocks++] = i + 1; // 1-indexed relative to data region
+    uint64_t filled = 0; // map entries set so far
+    uint32_t crc = 0; // of the new content, read in full anyway
+    for (uint64_t c = 0; c < new_blocks && !job->failed; c += PIPELINE_CHUNK_BLOCKS) {
+        uint64_t n = new_blocks - c < PIPELINE_CHUNK_BLOCKS ? new_blocks - c : PIPELINE_CHUNK_BLOCKS;
+        uint64_t len = c * BS + n * BS > job->size ? job->size - c * BS : n * BS;
+        if (read_chunk(job->fd, buf, c * BS, len) != 0) {
+            add_fail(job, "Failed to read file data", EIO);
+            break;
+        }
+        crc = crc32_update(crc, buf, len);
+        memset(buf + len, 0, n * BS - len); // clear the tail
+        for (uint64_t i = 0; i < n; i++, filled++) {
+            const uint8_t* data = buf + i * BS;
+            uint32_t old = c + i < old_blocks ? inode_block_at(fs, ino, c + i) : 0;
+            map[c + i] = old;
+            if (old != 0 ? memcmp(fs_block(fs, old), data, BS) == 0 : block_is_zero(data)) {
+                continue; // unchanged
+            }
+            map[c + i] = 0; // a hole unless it holds data
+            if (!block_is_zero(data) && update_new_block(job, data, &map[c + i]) != 0) {
+                add_fail(job, "Not enough free data blocks available", ENOSPC);
+                break;
+            }
+            job->rewritten++;
         }
     }
-    
-    if (found_blocks < blocks_needed) {
-        perror("Not enough free data blocks available");
-        free(img_data);
+    bufpool_put(&job->ing->buffers, buf);
+
+    uint64_t meta_count = job->failed ? 0 : map_blocks_needed_sparse(map, new_blocks);
+    uint32_t* meta = job->failed ? NULL : arena_alloc(&job->ing->arena, (meta_count + 1) * sizeof(uint32_t));
+    if (!job->failed && (!meta || fs_alloc_blocks(fs, meta, meta_count) != 0)) {
+        add_fail(job, meta ? "Not enough free data blocks available" : "Memory allocation failed",
+                 meta ? ENOSPC : ENOMEM);
+    }
+    if (job->failed) {
+        // Only the new blocks go; the inode still points at the old ones
+        for (uint64_t i = 0; i < filled; i++) {
+            uint32_t old = i < old_blocks ? inode_block_at(fs, ino, i) : 0;
+            if (map[i] != 0 && map[i] != old) {
+                fs_release_block(fs, map[i]);
+            }
+        }
         return -1;
     }
 
-    // Read the file to be added
-    FILE* file_to_add = fopen(file_path, "rb");
-    if (!file_to_add) {
-        perror("Cannot open file to add");
-        free(img_data);
+    // Switch the inode to the new map in one store, then drop the old map
+    time_t now = time(NULL);
+    inode_t next = *ino;
+    inode_set_block_map(fs, &next, map, new_blocks, meta);
+    next.flags = (next.flags & ~INODE_FLAG_COMPRESSED) | INODE_FLAG_DATA_CRC;
+    next.size_bytes = job->size;
+    next.mtime = (uint64_t)now;
+    next.ctime = (uint64_t)now;
+    next.data_crc = crc;
+    inode_checksum(&next);
+    inode_t old = *ino;
+    *ino = next;
+    update_release_old(fs, &old, map, old_blocks < new_blocks ? old_blocks : new_blocks);
+    return 0;
+}
+
+// --append to a file that is already in the image: store what the source
+// holds past the stored size. The last partial block is filled in place and
+// new blocks are taken first-fit from just after the file's last block, so an
+// append costs the appended bytes and leaves earlier blocks alone.
+int add_append(add_job_t* job, uint32_t inode_no) {
+    fs_image_t* fs = job->ing->fs;
+    inode_t* ino = fs_inode(fs, inode_no);
+    if (update_check_inode(job, ino) != 0) {
         return -1;
     }
-    
-    uint8_t* file_data = malloc(st.st_size);
-    if (!file_data) {
-        perror("Memory allocation failed");
-        free(img_data);
-        fclose(file_to_add);
+    if (ino->flags & INODE_FLAG_COMPRESSED) {
+        add_fail(job, "Cannot append to a compressed file", EINVAL);
         return -1;
     }
-    
-    if (fread(file_data, 1, st.st_size, file_to_add) != (size_t)st.st_size) {
-        perror("Failed to read file data");
-        free(img_data);
-        free(file_data);
-        fclose(file_to_add);
+    uint64_t old_size = ino->size_bytes;
+    if (job->size < old_size) {
+        add_fail(job, "File is shorter than the stored copy", EINVAL);
         return -1;
     }
-    fclose(file_to_add);
-    
-    // Create new inode for the file
-    inode_t* new_inode = &inode_table[free_inode - 1]; // adjust for 1-indexing
-    memset(new_inode, 0, sizeof(inode_t));
-    
-    time_t current_time = time(NULL);
-    new_inode->mode = 0100000;  // regular file mode (octal)
-    new_inode->links = 1;
-    new_inode->uid = 0;
-    new_inode->gid = 0;
-    new_inode->size_bytes = st.st_size;
-    new_inode->atime = (uint64_t)current_time;
-    new_inode->mtime = (uint64_t)current_time;
-    new_inode->ctime = (uint64_t)current_time;
-
-    // Set direct block pointers
-    for (uint32_t i = 0; i < blocks_needed; i++) {
-        new_inode->direct[i] = free_data_blocks[i];
-    }
-    for (uint32_t i = blocks_needed; i < DIRECT_MAX; i++) {
-        new_inode->direct[i] = 0;
+    uint8_t* buf = bufpool_get(&job->ing->buffers);
+    if (!buf) {
+        add_fail(job, "Memory allocation failed", ENOMEM);
+        return -1;
     }
-    
-    new_inode->reserved_0 = 0;
-    new_inode->reserved_1 = 0;
-    new_inode->reserved_2 = 0;
-    new_inode->proj_id = 0;
-    new_inode->uid16_gid16 = 0;
-    new_inode->xattr_ptr = 0;
-    
-    inode_crc_finalize(new_inode);
-    
-    // Update inode bitmap
-    set_bitmap_bit(inode_bitmap, free_inode);
-    
-    // Update data bitmap and write file data
-    for (uint32_t i = 0; i < blocks_needed; i++) {
-        set_bitmap_bit(data_bitmap, free_data_blocks[i]);
-        
-        // Write file data to the data block
-        uint64_t block_offset = (free_data_blocks[i] - 1) * BS; // adjust for 1-indexing
-        uint64_t data_to_write = BS;
-        uint64_t file_offset = i * BS;
-        
-        if (file_offset + BS > (uint64_t)st.st_size) {
-            data_to_write = st.st_size - file_offset;
+
+    uint64_t old_blocks = (old_size + BS - 1) / BS;
+    uint32_t last = old_blocks > 0 ? inode_block_at(fs, ino, old_blocks - 1) : 0;
+    uint32_t crc = ino->data_crc; // a stored crc extends over the appended bytes
+    uint64_t hint = g_data_hint_tls; // this worker's own spot, back once the append is done
+    if (last != 0) {
+        g_data_hint_tls = last; // the bit after the file's last block
+    }
+    for (uint64_t c = old_size / BS; c * BS < job->size && !job->failed; c += PIPELINE_CHUNK_BLOCKS) {
+        uint64_t end = (c + PIPELINE_CHUNK_BLOCKS) * BS < job->size ? (c + PIPELINE_CHUNK_BLOCKS) * BS : job->size;
+        uint64_t keep = c * BS < old_size ? old_size - c * BS : 0; // stored bytes heading the chunk
+        uint64_t n = (end - c * BS + BS - 1) / BS;
+        if ((keep > 0 && inode_read(fs, ino, c * BS, buf, keep, NULL) != 0) || // not compressed: no scratch
+            read_chunk(job->fd, buf + keep, c * BS + keep, end - c * BS - keep) != 0) {
+            add_fail(job, "Failed to read file data", EIO);
+            break;
+        }
+        crc = crc32_update(crc, buf + keep, end - c * BS - keep);
+        memset(buf + (end - c * BS), 0, n * BS - (end - c * BS)); // clear the tail
+        for (uint64_t i = 0; i < n; i++) {
+            const uint8_t* data = buf + i * BS;
+            uint32_t old = c + i < old_blocks ? inode_block_at(fs, ino, c + i) : 0;
+            if (old != 0 && !job->ing->dedup) {
+                memcpy(fs_block(fs, old) + keep, data + keep, BS - keep); // the partial last block
+                stats_add(STAT_BYTES_WRITTEN, BS - keep);
+                job->rewritten++;
+            } else if (old != 0 || !block_is_zero(data)) {
+                if (update_store_block(job, ino, c + i, old, data) != 0) {
+                    add_fail(job, "Not enough free data blocks available", ENOSPC);
+                    break;
+                }
+                job->rewritten++;
+            }
         }
-        
-        memset(data_region + block_offset, 0, BS); // clear block first
-        memcpy(data_region + block_offset, file_data + file_offset, data_to_write);
     }
-    
-    // Add directory entry to root directory
-    dirent64_t* root_entries = (dirent64_t*)data_region; // first data block is root directory
-    int max_entries = BS / sizeof(dirent64_t);
-    int free_entry_idx = find_free_dirent(root_entries, max_entries);
-    
-    if (free_entry_idx == -1) {
-        perror("No free directory entry available in root directory");
-        free(img_data);
-        free(file_data);
+    bufpool_put(&job->ing->buffers, buf);
+    g_data_hint_tls = hint;
+
+    if (job->failed) {
+        inode_truncate_blocks(fs, ino, old_blocks); // the stored size still stands
+    } else {
+        time_t now = time(NULL);
+        job->appended = job->size - old_size;
+        ino->size_bytes = job->size;
+        ino->mtime = (uint64_t)now;
+        ino->ctime = (uint64_t)now;
+        ino->data_crc = crc; // only meaningful if INODE_FLAG_DATA_CRC was set
+    }
+    inode_checksum(ino);
+    return job->failed ? -1 : 0;
+}
+
+int add_begin(add_job_t* job) {
+    fs_image_t* fs = job->ing->fs;
+    struct stat st;
+    if (stat(job->path, &st) != 0) {
+        add_fail(job, "Cannot access file to add", errno);
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        add_fail(job, "File to add is not a regular file", EINVAL);
+        return -1;
+    }
+
+    if (((uint64_t)st.st_size + BS - 1) / BS > MAX_FILE_BLOCKS) {
+        add_fail(job, "File too large to add (exceeds block map limit)", EFBIG);
         return -1;
     }
 
     // Extract just the filename from the path
-    const char* filename = strrchr(file_path, '/');
+    const char* filename = strrchr(job->path, '/');
     if (filename) {
         filename++; // skip the '/'
     } else {
-        filename = file_path; // no path separator found
+        filename = job->path; // no path separator found
     }
     
     if (strlen(filename) >= 58) {
-        perror("Filename too long to add (exceeds 57 characters)");
-        free(img_data);
-        free(file_data);
+        add_fail(job, "Filename too long to add (exceeds 57 characters)", ENAMETOOLONG);
         return -1;
     }
-    
-    for (int i = 2; i < max_entries; i++) {
-    if (root_entries[i].inode_no != 0 &&
-        strcmp(root_entries[i].name, filename) == 0) {
-        perror("File already exists");
-        free(img_data);
-        free(file_data);
+    job->filename = filename;
+
+    // Reserve the directory entry up front, and fail fast on duplicates
+    uint64_t t0 = stats_now();
+    int reserved = ingest_dir_reserve(job->ing) == 0;
+    int exists = reserved && ingest_dir_insert(job->ing, filename, 0) != 0;
+    if (exists) {
+        ingest_dir_unreserve(job->ing);
+    }
+    stats_phase_end(PHASE_DIR_RESERVE, t0);
+    if (!reserved) {
+        add_fail(job, "Cannot grow root directory", ENOSPC);
         return -1;
     }
-}
-
-    
-    // Create directory entry
-    dirent64_t* new_entry = &root_entries[free_entry_idx];
-    memset(new_entry, 0, sizeof(dirent64_t));
-    new_entry->inode_no = free_inode;
-    new_entry->type = 1; // file
-    strcpy(new_entry->name, filename);
-    dirent_checksum_finalize(new_entry);
-    
-    // Update root inode links count
-    inode_t* root_inode = &inode_table[ROOT_INO - 1]; // adjust for 1-indexing
-    root_inode->links++;
-    root_inode->mtime = (uint64_t)current_time;
-    inode_crc_finalize(root_inode);
-    
-    // Update superblock timestamp and checksum
-    sb->mtime_epoch = (uint64_t)current_time;
-    superblock_crc_finalize(sb);
+    if (exists) {
+        uint32_t inode_no = job->ing->update || job->ing->append ? ingest_dir_find(job->ing, filename) : 0;
+        if (inode_no == 0) {
+            add_fail(job, "File already exists", EEXIST);
+            return -1;
+        }
+        job->fd = open(job->path, O_RDONLY);
+        if (job->fd < 0) {
+            add_fail(job, "Cannot open file to add", errno);
+            return -1;
+        }
+        // Changed here; add_finish only closes the source
+        job->size = (uint64_t)st.st_size;
+        job->inode_no = inode_no;
+        job->updated = 1;
+        t0 = stats_now();
+        int changed = job->ing->append ? add_append(job, inode_no) : add_update(job, inode_no);
+        stats_phase_end(PHASE_UPDATE, t0);
+        if (changed != 0) {
+            close(job->fd);
+            job->fd = -1;
+            return -1;
+        }
+        return 0;
+    }
 
-    // Write updated image to output file
-    FILE* output_file = fopen(output_path, "wb");
-    if (!output_file) {
-        perror("Cannot open output image file");
-        free(img_data);
-        free(file_data);
+    job->fd = open(job->path, O_RDONLY);
+    if (job->fd < 0) {
+        add_fail(job, "Cannot open file to add", errno);
+        ingest_dir_unreserve(job->ing);
         return -1;
     }
-    
-    if (fwrite(img_data, 1, img_size, output_file) != (size_t)img_size) {
-        perror("Failed to write updated image data");
-        free(img_data);
-        free(file_data);
-        fclose(output_file);
+
+    job->size = (uint64_t)st.st_size;
+    if (job->ing->dedup_files) {
+        t0 = stats_now();
+        job->inode_no = add_find_identical(job);
+        stats_phase_end(PHASE_HASH, t0);
+        if (job->inode_no != 0) {
+            job->linked = 1; // nothing to allocate or copy
+            stats_add(STAT_FILES_LINKED, 1);
+            return 0;
+        }
+    }
+
+    // Calculate blocks needed for the file, plus the pointer blocks mapping them.
+    // A compressed file gets room for its chunk table and every chunk stored
+    // raw; add_compress_pack gives back what the stream does not use.
+    job->compressed = job->ing->compress && job->size > BS;
+    uint64_t stream_bytes = job->compressed ? compress_table_bytes(job->size) + job->size : job->size;
+    job->data_blocks = (stream_bytes + BS - 1) / BS; // ceiling division
+    job->map_blocks = map_blocks_needed(job->data_blocks);
+    job->blocks = arena_alloc(&job->ing->arena, (job->data_blocks + job->map_blocks + 1) * sizeof(uint32_t));
+    job->chunk_len = job->compressed ? arena_alloc(&job->ing->arena, compress_chunk_count(job->size) * sizeof(uint32_t))
+                                     : NULL;
+    t0 = stats_now();
+    if (job->data_blocks > MAX_FILE_BLOCKS) {
+        add_fail(job, "File too large to add (exceeds block map limit)", EFBIG);
+    } else if (!job->blocks || (job->compressed && !job->chunk_len)) {
+        add_fail(job, "Memory allocation failed", ENOMEM);
+    } else if (add_alloc_blocks(job) != 0) {
+        add_fail(job, "Not enough free data blocks available", ENOSPC);
+    } else if ((job->inode_no = fs_alloc_inode(fs)) == 0) {
+        add_fail(job, "No free inode available", ENOSPC);
+        for (uint64_t i = 0; i < job->data_blocks + job->map_blocks; i++) {
+            if (job->blocks[i] != 0) {
+                fs_free_block(fs, job->blocks[i]);
+            }
+        }
+    }
+    stats_phase_end(PHASE_ALLOC, t0);
+    if (job->failed) {
+        job->blocks = NULL; // arena memory, recycled at commit
+        close(job->fd);
+        job->fd = -1;
+        ingest_dir_unreserve(job->ing);
         return -1;
     }
-    
-    fclose(output_file);
-    free(img_data);
-    free(file_data);
-    
-    printf("Successfully added file %s to filesystem\n", filename);
-    printf("Used inode %u and %lu data blocks\n", free_inode, blocks_needed);
-    
     return 0;
-
 }
 
-int main(int argc, char* argv[]) {
-    crc32_init();
-    
-    char* input_path;
-    char* output_path;
-    char* file_path;
-    
-    if (parse_args(argc, argv, &input_path, &output_path, &file_path) != 0) {
-        print_usage(argv[0]);
-        return 1;
+// Dedup flavour of read_into_blocks: read through a pool buffer, and store
+// each block only if the index has no identical one. A shared block replaces
+// the one add_begin allocated, which goes straight back to the bitmap.
+int read_dedup_blocks(add_job_t* job, uint64_t first, uint64_t count) {
+    fs_image_t* fs = job->ing->fs;
+    uint8_t* buf = bufpool_get(&job->ing->buffers);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
     }
-    
-    if (add_file_to_filesystem(input_path, output_path, file_path) != 0) {
-        return 1;
+    for (uint64_t c = first; c < first + count; c += PIPELINE_CHUNK_BLOCKS) {
+        uint64_t n = first + count - c < PIPELINE_CHUNK_BLOCKS ? first + count - c : PIPELINE_CHUNK_BLOCKS;
+        uint64_t len = c * BS + n * BS > job->size ? job->size - c * BS : n * BS;
+        if (read_chunk(job->fd, buf, c * BS, len) != 0) {
+            bufpool_put(&job->ing->buffers, buf);
+            return -1;
+        }
+        memset(buf + len, 0, n * BS - len); // clear the tail
+
+        for (uint64_t i = 0; i < n; i++) {
+            const uint8_t* data = buf + i * BS;
+            if (job->blocks[c + i] == 0) {
+                continue; // a hole in the source
+            }
+            add_drop_zero_block(fs, job->blocks, c + i, data);
+            if (job->blocks[c + i] == 0) {
+                continue;
+            }
+            uint64_t hash[2];
+            dedup_hash(data, hash);
+            uint32_t shared = dedup_share(fs, hash, data);
+            if (shared != 0) {
+                fs_free_block(fs, job->blocks[c + i]);
+                job->blocks[c + i] = shared;
+                __atomic_add_fetch(&job->shared, 1, __ATOMIC_RELAXED);
+                stats_add(STAT_BLOCKS_DEDUPED, 1);
+                continue;
+            }
+            memcpy(fs_block(fs, job->blocks[c + i]), data, BS);
+            dedup_insert(fs, hash, job->blocks[c + i]);
+            stats_add(STAT_BYTES_WRITTEN, BS);
+        }
     }
-    
+    bufpool_put(&job->ing->buffers, buf);
     return 0;
 }
+
+// Copy len bytes into the stream held by blocks[], from stream offset off
+void stream_write(fs_image_t* fs, const uint32_t* blocks, uint64_t off, const uint8_t* src, uint64_t len) {
+    while (len > 0) {
+        uint64_t piece = BS - off % BS < len ? BS - off % BS : len;
+        memcpy(fs_block(fs, blocks[off / BS]) + off % BS, src, piece);
+        src += piece;
+        off += piece;
+        len -= piece;
+    }
+}
+
+// Move len stream bytes from src down to dst (dst < src)
+void stream_move(fs_image_t* fs, const uint32_t* blocks, uint64_t dst, uint64_t src, uint64_t len) {
+    while (len > 0) {
+        uint64_t piece = len;
+        piece = BS - dst % BS < piece ? BS - dst % BS : piece;
+        piece = BS - src % BS < piece ? BS - src % BS : piece;
+        memmove(fs_block(fs, blocks[dst / BS]) + dst % BS, fs_block(fs, blocks[src / BS]) + src % BS, piece);
+        dst += piece;
+        src += piece;
+        len -= piece;
+    }
+}
+
+// Compressed flavour of read_into_blocks, for the chunks that start in file
+// blocks [first, first + count). Each chunk is written at its raw position in
+// the stream (after the table); add_compress_pack closes the gaps.
+int compress_blocks(add_job_t* job, uint64_t first, uint64_t count) {
+    fs_image_t* fs = job->ing->fs;
+    uint64_t chunks = compress_chunk_count(job->size);
+    uint64_t c_end = (first + count + COMPRESS_CHUNK_BLOCKS - 1) / COMPRESS_CHUNK_BLOCKS;
+    uint8_t* buf = bufpool_get(&job->ing->buffers); // the chunk, then its compressed form
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (uint64_t c = first / COMPRESS_CHUNK_BLOCKS; c < c_end && c < chunks; c++) {
+        uint64_t off = c * COMPRESS_CHUNK_BYTES;
+        uint32_t len = (uint32_t)(job->size - off < COMPRESS_CHUNK_BYTES ? job->size - off : COMPRESS_CHUNK_BYTES);
+        if (read_chunk(job->fd, buf, off, len) != 0) {
+            bufpool_put(&job->ing->buffers, buf);
+            return -1;
+        }
+        uint8_t* out = buf + COMPRESS_CHUNK_BYTES;
+        uint32_t stored = lz_compress(buf, len, out, len - 1);
+        if (stored == 0) {
+            out = buf; // does not compress: store it raw
+            stored = len;
+        }
+        stream_write(fs, job->blocks, compress_table_bytes(job->size) + off, out, stored);
+        job->chunk_len[c] = stored;
+        stats_add(STAT_BYTES_WRITTEN, stored);
+    }
+    bufpool_put(&job->ing->buffers, buf);
+    return 0;
+}
+
+// Once every chunk is in: slide the chunks together behind the offset table,
+// write the table, and free the blocks the stream does not reach
+void add_compress_pack(add_job_t* job) {
+    fs_image_t* fs = job->ing->fs;
+    uint64_t chunks = compress_chunk_count(job->size);
+    uint64_t table = compress_table_bytes(job->size);
+    uint64_t* offsets = arena_alloc(&job->ing->arena, table);
+    if (!offsets) {
+        add_fail(job, "Memory allocation failed", ENOMEM);
+        return;
+    }
+    uint64_t end = table;
+    for (uint64_t c = 0; c < chunks; c++) {
+        uint64_t raw_at = table + c * COMPRESS_CHUNK_BYTES;
+        if (end != raw_at) {
+            stream_move(fs, job->blocks, end, raw_at, job->chunk_len[c]);
+        }
+        offsets[c] = end;
+        end += job->chunk_len[c];
+    }
+    offsets[chunks] = end;
+    stream_write(fs, job->blocks, 0, (const uint8_t*)offsets, table);
+    if (end % BS != 0) {
+        memset(fs_block(fs, job->blocks[end / BS]) + end % BS, 0, BS - end % BS); // clear the tail
+    }
+
+    uint64_t data_blocks = (end + BS - 1) / BS;
+    uint64_t map_blocks = map_blocks_needed(data_blocks);
+    for (uint64_t i = data_blocks; i < job->data_blocks; i++) {
+        fs_free_block(fs, job->blocks[i]);
+    }
+    for (uint64_t i = job->data_blocks + map_blocks; i < job->data_blocks + job->map_blocks; i++) {
+        fs_free_block(fs, job->blocks[i]);
+    }
+    memmove(job->blocks + data_blocks, job->blocks + job->data_blocks, map_blocks * sizeof(uint32_t));
+    job->data_blocks = data_blocks;
+    job->map_blocks = map_blocks;
+}
+
+void add_copy(add_job_t* job, uint64_t first, uint64_t count) {
+    if (job->updated || job->linked) {
+        return; // already stored by add_begin, or nothing to store
+    }
+    uint64_t t0 = stats_now();
+    int rc = job->compressed ? compress_blocks(job, first, count)
+           : job->ing->dedup ? read_dedup_blocks(job, first, count)
+                             : read_into_blocks(job->ing->fs, job->fd, job->blocks, first, count, job->size);
+    if (rc != 0) {
+        add_fail(job, "Failed to read file data", errno ? errno : EIO);
+    }
+    stats_phase_end(PHASE_COPY, t0);
+}
+
+// Large-file ingest as three stages, each on its own thread, joined by a ring
+// of block-aligned buffers: read the source, checksum it, write it into the
+// image. A slot goes free -> read -> checked -> free, and with two slots per
+// stage every stage always has a buffer to work on, so the copy runs at the
+// speed of the slowest stage instead of the sum of the three.
+
+enum { PIPE_FREE, PIPE_READ, PIPE_CHECKED };
+
+typedef struct {
+    add_job_t* job;
+    uint8_t* slot_buf[PIPELINE_SLOTS];    // from the session's buffer pool
+    uint64_t chunks;
+    uint64_t slot_chunk[PIPELINE_SLOTS];  // chunk the slot holds, or is free for
+    int slot_stage[PIPELINE_SLOTS];
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} add_pipeline_t;
+
+// Wait until chunk c has reached stage; NULL if another stage failed
+uint8_t* pipeline_wait(add_pipeline_t* p, uint64_t c, int stage) {
+    uint32_t s = (uint32_t)(c % PIPELINE_SLOTS);
+    pthread_mutex_lock(&p->lock);
+    while (!p->failed && !(p->slot_chunk[s] == c && p->slot_stage[s] == stage)) {
+        pthread_cond_wait(&p->changed, &p->lock);
+    }
+    int failed = p->failed;
+    pthread_mutex_unlock(&p->lock);
+    return failed ? NULL : p->slot_buf[s];
+}
+
+// Hand chunk c on to the next stage; a freed slot is reserved for the chunk
+// PIPELINE_SLOTS further on
+void pipeline_advance(add_pipeline_t* p, uint64_t c, int stage) {
+    uint32_t s = (uint32_t)(c % PIPELINE_SLOTS);
+    pthread_mutex_lock(&p->lock);
+    p->slot_stage[s] = stage;
+    if (stage == PIPE_FREE) {
+        p->slot_chunk[s] = c + PIPELINE_SLOTS;
+    }
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pipeline_fail(add_pipeline_t* p, const char* err, int err_no) {
+    add_fail(p->job, err, err_no);
+    pthread_mutex_lock(&p->lock);
+    p->failed = 1;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+uint64_t pipeline_chunk_bytes(const add_pipeline_t* p, uint64_t c) {
+    uint64_t offset = c * PIPELINE_CHUNK_BLOCKS * BS;
+    uint64_t left = p->job->size - offset;
+    return left < PIPELINE_CHUNK_BLOCKS * BS ? left : PIPELINE_CHUNK_BLOCKS * BS;
+}
+
+void* pipeline_reader(void* arg) {
+    add_pipeline_t* p = arg;
+    for (uint64_t c = 0; c < p->chunks; c++) {
+        uint8_t* buf = pipeline_wait(p, c, PIPE_FREE);
+        if (!buf) {
+            break;
+        }
+        uint64_t len = pipeline_chunk_bytes(p, c);
+        uint64_t done = 0;
+        if (map_range_is_hole(p->job->blocks + c * PIPELINE_CHUNK_BLOCKS, (len + BS - 1) / BS)) {
+            memset(buf, 0, len); // a hole in the source: nothing to read
+            done = len;
+        }
+        while (done < len) {
+            ssize_t n = pread(p->job->fd, buf + done, len - done, (off_t)(c * PIPELINE_CHUNK_BLOCKS * BS + done));
+            if (n <= 0) {
+                pipeline_fail(p, "Failed to read file data", n < 0 ? errno : EIO);
+                return NULL;
+            }
+            done += (uint64_t)n;
+        }
+        memset(buf + len, 0, (len + BS - 1) / BS * BS - len); // clear the tail of the last block
+        stats_add(STAT_BYTES_READ, len);
+        pipeline_advance(p, c, PIPE_READ);
+    }
+    return NULL;
+}
+
+void* pipeline_writer(void* arg) {
+    add_pipeline_t* p = arg;
+    const fs_image_t* fs = p->job->ing->fs;
+    for (uint64_t c = 0; c < p->chunks; c++) {
+        uint8_t* buf = pipeline_wait(p, c, PIPE_CHECKED);
+        if (!buf) {
+            break;
+        }
+        // Whole blocks, one pwrite per contiguous run of the chunk's blocks;
+        // holes and all-zero blocks are not written
+        uint32_t* blocks = p->job->blocks + c * PIPELINE_CHUNK_BLOCKS;
+        uint64_t count = (pipeline_chunk_bytes(p, c) + BS - 1) / BS;
+        for (uint64_t i = 0; i < count; i++) {
+            if (blocks[i] != 0) {
+                add_drop_zero_block(p->job->ing->fs, blocks, i, buf + i * BS);
+            }
+        }
+        for (uint64_t i = 0; i < count;) {
+            if (blocks[i] == 0) {
+                i++;
+                continue;
+            }
+            uint64_t run = 1;
+            while (i + run < count && blocks[i + run] == blocks[i] + run) {
+                run++;
+            }
+            off_t pos = (off_t)((fs->sb->data_region_start + blocks[i] - 1) * BS);
+            if (pwrite(fs->fd, buf + i * BS, run * BS, pos) != (ssize_t)(run * BS)) {
+                pipeline_fail(p, "Failed to write file data to image", errno ? errno : EIO);
+                return NULL;
+            }
+            stats_add(STAT_BYTES_WRITTEN, run * BS);
+            i += run;
+        }
+        pipeline_advance(p, c, PIPE_FREE);
+    }
+    return NULL;
+}
+
+// Copy a whole file through the pipeline; the checksum stage runs here.
+// Writes go through the image fd, which shares the page cache with the mapping.
+void add_copy_pipelined(add_job_t* job) {
+    uint64_t t0 = stats_now();
+    add_pipeline_t p;
+    memset(&p, 0, sizeof(p));
+    p.job = job;
+    p.chunks = (job->data_blocks + PIPELINE_CHUNK_BLOCKS - 1) / PIPELINE_CHUNK_BLOCKS;
+    for (uint32_t s = 0; s < PIPELINE_SLOTS; s++) {
+        p.slot_chunk[s] = s;
+        p.slot_buf[s] = bufpool_get(&job->ing->buffers);
+        if (!p.slot_buf[s]) {
+            add_fail(job, "Memory allocation failed", ENOMEM);
+            for (uint32_t k = 0; k < s; k++) {
+                bufpool_put(&job->ing->buffers, p.slot_buf[k]);
+            }
+            return;
+        }
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.changed, NULL);
+
+    pthread_t reader, writer;
+    int have_reader = pthread_create(&reader, NULL, pipeline_reader, &p) == 0;
+    int have_writer = have_reader && pthread_create(&writer, NULL, pipeline_writer, &p) == 0;
+    if (!have_writer) {
+        pipeline_fail(&p, "Cannot start ingest pipeline", EAGAIN);
+    }
+
+    uint32_t crc = 0;
+    for (uint64_t c = 0; have_writer && c < p.chunks; c++) {
+        uint8_t* buf = pipeline_wait(&p, c, PIPE_READ);
+        if (!buf) {
+            break;
+        }
+        crc = crc32_update(crc, buf, pipeline_chunk_bytes(&p, c));
+        pipeline_advance(&p, c, PIPE_CHECKED);
+    }
+
+    if (have_reader) {
+        pthread_join(reader, NULL);
+    }
+    if (have_writer) {
+        pthread_join(writer, NULL);
+    }
+    job->data_crc = crc;
+    job->has_crc = !job->failed;
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.changed);
+    for (uint32_t s = 0; s < PIPELINE_SLOTS; s++) {
+        bufpool_put(&job->ing->buffers, p.slot_buf[s]);
+    }
+    stats_phase_end(PHASE_COPY, t0);
+}
+
+// Remember a stored file for --dedup-files, hashing what the image holds
+void add_index_file(add_job_t* job) {
+    fs_image_t* fs = job->ing->fs;
+    uint64_t hash[2] = { 0, 0 };
+    if (!job->compressed) {
+        for (uint64_t i = 0; i < job->data_blocks; i++) {
+            file_hash_block(hash, fs_block(fs, job->blocks[i]));
+        }
+        file_index_add(&job->ing->files, job->size, hash, job->inode_no);
+        return;
+    }
+    uint8_t* buf = bufpool_get(&job->ing->buffers);
+    if (!buf) {
+        return;
+    }
+    const inode_t* ino = fs_inode(fs, job->inode_no);
+    for (uint64_t off = 0; off < job->size; off += COMPRESS_CHUNK_BYTES) {
+        uint64_t len = job->size - off < COMPRESS_CHUNK_BYTES ? job->size - off : COMPRESS_CHUNK_BYTES;
+        if (inode_read(fs, ino, off, buf, len, buf + COMPRESS_CHUNK_BYTES) != 0) {
+            bufpool_put(&job->ing->buffers, buf);
+            return;
+        }
+        memset(buf + len, 0, (BS - len % BS) % BS);
+        for (uint64_t b = 0; b * BS < len; b++) {
+            file_hash_block(hash, buf + b * BS);
+        }
+    }
+    bufpool_put(&job->ing->buffers, buf);
+    file_index_add(&job->ing->files, job->size, hash, job->inode_no);
+}
+
+int add_finish(add_job_t* job) {
+    uint64_t t0;
+    fs_image_t* fs = job->ing->fs;
+    close(job->fd);
+    job->fd = -1;
+    if (job->updated) {
+        stats_phase_end(PHASE_FILE, job->started);
+        return 0;
+    }
+
+    int rc = -1;
+    if (!job->failed && job->compressed) {
+        t0 = stats_now();
+        add_compress_pack(job);
+        stats_phase_end(PHASE_PACK, t0);
+    }
+    if (!job->failed && !job->linked) {
+        // Create new inode for the file
+        inode_t* new_inode = fs_inode(fs, job->inode_no);
+        memset(new_inode, 0, sizeof(inode_t));
+        
+        time_t current_time = time(NULL);
+        new_inode->mode = 0100000;  // regular file mode (octal)
+        new_inode->links = 1;
+        new_inode->uid = 0;
+        new_inode->gid = 0;
+        new_inode->size_bytes = job->size;
+        new_inode->atime = (uint64_t)current_time;
+        new_inode->mtime = (uint64_t)current_time;
+        new_inode->ctime = (uint64_t)current_time;
+
+        // Direct block pointers, then indirect pointer blocks for the rest;
+        // pointer blocks whose span turned out to be all holes go back
+        uint64_t map_used = inode_set_block_map(fs, new_inode, job->blocks, job->data_blocks,
+                                                job->blocks + job->data_blocks);
+        for (uint64_t i = map_used; i < job->map_blocks; i++) {
+            fs_free_block(fs, job->blocks[job->data_blocks + i]);
+        }
+        job->map_blocks = map_used;
+        for (uint64_t i = 0; i < job->data_blocks; i++) {
+            job->holes += job->blocks[i] == 0;
+        }
+        stats_add(STAT_HOLE_BLOCKS, job->holes);
+        
+        new_inode->proj_id = 0;
+        new_inode->uid16_gid16 = 0;
+        new_inode->flags = (job->compressed ? INODE_FLAG_COMPRESSED : 0) | (job->has_crc ? INODE_FLAG_DATA_CRC : 0);
+        new_inode->data_crc = job->has_crc ? job->data_crc : 0;
+        
+        inode_checksum(new_inode);
+    }
+
+    if (!job->failed) {
+        // Create directory entry; a concurrent add of the same name may have won
+        t0 = stats_now();
+        rc = ingest_dir_insert(job->ing, job->filename, job->inode_no);
+        stats_phase_end(PHASE_DIR_INSERT, t0);
+        if (rc != 0) {
+            add_fail(job, rc > 0 ? "File already exists" : "No free directory entry available in root directory",
+                     rc > 0 ? EEXIST : ENOSPC);
+        }
+    }
+
+    if (rc != 0 && job->linked) {
+        // Give back the link taken by add_find_identical
+        pthread_mutex_lock(&job->ing->files.lock);
+        inode_t* ino = fs_inode(fs, job->inode_no);
+        ino->links--;
+        inode_checksum(ino);
+        pthread_mutex_unlock(&job->ing->files.lock);
+        job->inode_no = 0;
+        ingest_dir_unreserve(job->ing);
+    } else if (rc != 0) {
+        // Undo the allocations of the failed add; data blocks may be shared
+        for (uint64_t i = 0; i < job->data_blocks; i++) {
+            if (job->blocks[i] != 0) {
+                fs_release_block(fs, job->blocks[i]);
+            }
+        }
+        for (uint64_t i = job->data_blocks; i < job->data_blocks + job->map_blocks; i++) {
+            fs_free_block(fs, job->blocks[i]);
+        }
+        fs_free_inode(fs, job->inode_no);
+        job->inode_no = 0;
+        ingest_dir_unreserve(job->ing);
+    } else {
+        __atomic_add_fetch(&job->ing->added, 1, __ATOMIC_RELAXED);
+        if (job->ing->dedup_files && !job->linked) {
+            t0 = stats_now();
+            add_index_file(job);
+            stats_phase_end(PHASE_INDEX, t0);
+        }
+    }
+    job->blocks = NULL;
+    stats_phase_end(PHASE_FILE, job->started);
+    return rc == 0 ? 0 : -1;
+}
+
+// Add one host file to the root directory. On failure *err names the step
+// that failed (with errno set) and the image is left as it was. Safe to call
+// from several threads sharing ing; the caller commits with ingest_commit.
+int fs_add_file(ingest_t* ing, const char* file_path, uint32_t* inode_out, uint64_t* blocks_out, const char** err) {
+    add_job_t job;
+    add_job_init(&job, ing, file_path);
+    job.started = stats_now();
+    int begun = add_begin(&job);
+    if (begun == 0) {
+        if (job.data_blocks >= PIPELINE_MIN_BLOCKS && !ing->dedup && !job.compressed) {
+            add_copy_pipelined(&job);
+        } else {
+            add_copy(&job, 0, job.data_blocks);
+        }
+        add_finish(&job);
+    }
+    if (job.failed) {
+        *err = job.err;
+        errno = job.err_no;
+        return -1;
+    }
+    *inode_out = job.inode_no;
+    *blocks_out = job.updated ? job.rewritten : job.data_blocks + job.map_blocks - job.shared - job.holes;
+    return 0;
+}
+
+#define EXTRACT_SCRATCH_BYTES (COMPRESS_CHUNK_BYTES + INODE_READ_SCRATCH_BYTES) // a chunk, then inode_read scratch
+
+// One file being copied out of the root directory, split like an add
+typedef struct {
+    const fs_image_t* fs;
+    const char* name;
+    char dest[PATH_MAX];
+    int fd;
+    const inode_t* inode;
+    bufpool_t* buffers;       // scratch for compressed files (EXTRACT_SCRATCH_BYTES)
+    uint64_t ranges_left;     // block-range copies still running (atomic)
+    int failed;               // atomic
+    const char* err;
+    int err_no;
+} extract_job_t;
+
+void extract_fail(extract_job_t* job, const char* err, int err_no) {
+    if (!__atomic_exchange_n(&job->failed, 1, __ATOMIC_ACQ_REL)) {
+        job->err = err;
+        job->err_no = err_no;
+    }
+}
+
+void extract_job_init(extract_job_t* job, const fs_image_t* fs, bufpool_t* buffers, const char* name,
+                      const char* dest_path) {
+    memset(job, 0, sizeof(*job));
+    job->fs = fs;
+    job->buffers = buffers;
+    job->name = name;
+    snprintf(job->dest, sizeof(job->dest), "%s", dest_path);
+    job->fd = -1;
+}
+
+int extract_begin(extract_job_t* job) {
+    dirent64_t* de = dir_lookup(job->fs, fs_inode(job->fs, ROOT_INO), job->name);
+    if (!de || de->type != 1) {
+        extract_fail(job, "No such file in root directory", ENOENT);
+        return -1;
+    }
+    job->inode = fs_inode(job->fs, de->inode_no);
+
+    // Size the file up front so ranges can be written in any order; holes stay holes
+    job->fd = open(job->dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (job->fd < 0) {
+        extract_fail(job, "Cannot open extract destination", errno);
+        return -1;
+    }
+    if (ftruncate(job->fd, (off_t)job->inode->size_bytes) != 0) {
+        extract_fail(job, "Failed to write extracted file", errno);
+        close(job->fd);
+        job->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t extract_blocks(const extract_job_t* job) {
+    return (job->inode->size_bytes + BS - 1) / BS;
+}
+
+int extract_write(extract_job_t* job, const uint8_t* src, uint64_t len, uint64_t offset) {
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(job->fd, src + done, len - done, (off_t)(offset + done));
+        if (n <= 0) {
+            extract_fail(job, "Failed to write extracted file", n < 0 ? errno : EIO);
+            break;
+        }
+        done += (uint64_t)n;
+    }
+    stats_add(STAT_BYTES_WRITTEN, done);
+    return done == len ? 0 : -1;
+}
+
+// Compressed files are written a chunk at a time
+void extract_copy_compressed(extract_job_t* job, uint64_t first, uint64_t count) {
+    uint64_t size = job->inode->size_bytes;
+    uint64_t end = (first + count) * BS < size ? (first + count) * BS : size;
+    uint8_t* buf = bufpool_get(job->buffers);
+    if (!buf) {
+        extract_fail(job, "Memory allocation failed", ENOMEM);
+        return;
+    }
+    for (uint64_t off = first * BS; off < end && !job->failed; off += COMPRESS_CHUNK_BYTES) {
+        uint64_t len = end - off < COMPRESS_CHUNK_BYTES ? end - off : COMPRESS_CHUNK_BYTES;
+        if (inode_read(job->fs, job->inode, off, buf, len, buf + COMPRESS_CHUNK_BYTES) != 0) {
+            extract_fail(job, "Compressed file data is corrupt", EIO);
+            break;
+        }
+        extract_write(job, buf, len, off);
+    }
+    bufpool_put(job->buffers, buf);
+}
+
+// Write file blocks [first, first + count), one pwrite per contiguous run
+void extract_copy(extract_job_t* job, uint64_t first, uint64_t count) {
+    uint64_t t0 = stats_now();
+    uint64_t size = job->inode->size_bytes;
+    uint64_t b = first;
+    if (job->inode->flags & INODE_FLAG_COMPRESSED) {
+        extract_copy_compressed(job, first, count);
+        b = first + count;
+    }
+    while (b < first + count && !job->failed) {
+        uint32_t blk = inode_block_at(job->fs, job->inode, b);
+        if (blk == 0) {
+            b++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (b + run < first + count && inode_block_at(job->fs, job->inode, b + run) == blk + run) {
+            run++;
+        }
+        uint64_t len = size - b * BS < run * BS ? size - b * BS : run * BS;
+        extract_write(job, fs_block(job->fs, blk), len, b * BS);
+        b += run;
+    }
+    stats_phase_end(PHASE_COPY, t0);
+}
+
+int extract_finish(extract_job_t* job) {
+    if (close(job->fd) != 0) {
+        extract_fail(job, "Failed to write extracted file", errno);
+    }
+    job->fd = -1;
+    return job->failed ? -1 : 0;
+}
+
+// Copy a file out of the root directory to a host path, taking scratch from
+// buffers (at least EXTRACT_SCRATCH_BYTES each)
+int fs_extract_file(const fs_image_t* fs, bufpool_t* buffers, const char* name, const char* dest_path,
+                    uint64_t* size_out, const char** err) {
+    extract_job_t job;
+    extract_job_init(&job, fs, buffers, name, dest_path);
+    if (extract_begin(&job) == 0) {
+        extract_copy(&job, 0, extract_blocks(&job));
+        extract_finish(&job);
+    }
+    if (job.failed) {
+        *err = job.err;
+        errno = job.err_no;
+        return -1;
+    }
+    *size_out = job.inode->size_bytes;
+    return 0;
+}
+
+// ===============================BATCH PIPELINES================================
+// Batch adds and extracts run on a work-stealing pool: one task per file, and
+// files larger than WS_RANGE_BLOCKS get one stealable task per block range,
+// the last of which finishes the file.
+
+__thread int g_alloc_spread_done;
+
+void batch_add_range(ws_pool_t* pool, void* arg, uint64_t first, uint64_t count) {
+    (void)pool;
+    add_job_t* job = arg;
+    add_copy(job, first, count);
+    if (__atomic_sub_fetch(&job->ranges_left, 1, __ATOMIC_ACQ_REL) == 0) {
+        add_finish(job);
+    }
+}
+
+void batch_add_task(ws_pool_t* pool, void* arg, uint64_t first, uint64_t count) {
+    (void)first;
+    (void)count;
+    add_job_t* job = arg;
+    if (!g_alloc_spread_done) {
+        // each worker allocates from its own part of the bitmaps
+        fs_alloc_spread(job->ing->fs, (unsigned)g_ws_worker, pool->workers);
+        g_alloc_spread_done = 1;
+    }
+    job->started = stats_now();
+    int begun = add_begin(job);
+    if (begun != 0) {
+        return;
+    }
+    uint64_t ranges = (job->data_blocks + WS_RANGE_BLOCKS - 1) / WS_RANGE_BLOCKS;
+    if (ranges <= 1) {
+        add_copy(job, 0, job->data_blocks);
+        add_finish(job);
+        return;
+    }
+    if (pool->workers == 1 && job->data_blocks >= PIPELINE_MIN_BLOCKS && !job->ing->dedup && !job->compressed) {
+        // nobody to steal ranges: overlap reading and writing within the file instead
+        add_copy_pipelined(job);
+        add_finish(job);
+        return;
+    }
+    job->ranges_left = ranges;
+    for (uint64_t r = 0; r < ranges; r++) {
+        uint64_t start = r * WS_RANGE_BLOCKS;
+        uint64_t n = job->data_blocks - start < WS_RANGE_BLOCKS ? job->data_blocks - start : WS_RANGE_BLOCKS;
+        if (ws_push(pool, batch_add_range, job, start, n) != 0) {
+            batch_add_range(pool, job, start, n); // no room to queue it: copy it here
+        }
+    }
+}
+
+void batch_extract_range(ws_pool_t* pool, void* arg, uint64_t first, uint64_t count) {
+    (void)pool;
+    extract_job_t* job = arg;
+    extract_copy(job, first, count);
+    if (__atomic_sub_fetch(&job->ranges_left, 1, __ATOMIC_ACQ_REL) == 0) {
+        extract_finish(job);
+    }
+}
+
+void batch_extract_task(ws_pool_t* pool, void* arg, uint64_t first, uint64_t count) {
+    (void)first;
+    (void)count;
+    extract_job_t* job = arg;
+    if (extract_begin(job) != 0) {
+        return;
+    }
+    uint64_t blocks = extract_blocks(job);
+    uint64_t ranges = (blocks + WS_RANGE_BLOCKS - 1) / WS_RANGE_BLOCKS;
+    if (ranges <= 1) {
+        extract_copy(job, 0, blocks);
+        extract_finish(job);
+        return;
+    }
+    job->ranges_left = ranges;
+    for (uint64_t r = 0; r < ranges; r++) {
+        uint64_t start = r * WS_RANGE_BLOCKS;
+        uint64_t n = blocks - start < WS_RANGE_BLOCKS ? blocks - start : WS_RANGE_BLOCKS;
+        if (ws_push(pool, batch_extract_range, job, start, n) != 0) {
+            batch_extract_range(pool, job, start, n);
+        }
+    }
+}
+
+// Add every file in one session: map the image once, add on jobs workers,
+// commit once
+int add_files_to_filesystem(const char* input_path, const char* output_path, char** file_paths, int file_count,
+                            int jobs, int huge_pages, int dedup, int dedup_files, int compress, int update,
+                            int append) {
+    fs_image_t fs;
+    uint64_t t0 = stats_now();
+    if (fs_open(&fs, input_path, output_path, huge_pages) != 0) {
+        return -1;
+    }
+    if (dedup && dedup_enable(&fs) != 0) {
+        fs_close(&fs);
+        return -1;
+    }
+    stats_phase_end(PHASE_OPEN, t0);
+    ingest_t ing;
+    ingest_init(&ing, &fs, huge_pages);
+    ing.dedup_files = dedup_files;
+    ing.compress = compress;
+    ing.update = update;
+    ing.append = append;
+
+    ws_pool_t pool;
+    add_job_t* add_jobs = arena_alloc(&ing.arena, (size_t)file_count * sizeof(add_job_t));
+    if (!add_jobs || ws_init(&pool, (unsigned)(jobs < file_count ? jobs : file_count)) != 0) {
+        perror("Memory allocation failed");
+        ingest_destroy(&ing);
+        fs_close(&fs);
+        return -1;
+    }
+    for (int i = 0; i < file_count; i++) {
+        add_job_init(&add_jobs[i], &ing, file_paths[i]);
+        if (ws_push(&pool, batch_add_task, &add_jobs[i], 0, 0) != 0) {
+            add_fail(&add_jobs[i], "Memory allocation failed", ENOMEM);
+        }
+    }
+    ws_run(&pool);
+    ws_destroy(&pool);
+
+    int added = 0;
+    for (int i = 0; i < file_count; i++) {
+        add_job_t* job = &add_jobs[i];
+        if (job->failed) {
+            errno = job->err_no;
+            perror(job->err);
+            continue;
+        }
+        if (job->updated && job->ing->append) {
+            printf("Successfully appended %" PRIu64 " bytes to file %s\n", job->appended, job->filename);
+            printf("Wrote %" PRIu64 " data blocks of inode %u\n", job->rewritten, job->inode_no);
+            added++;
+            continue;
+        }
+        if (job->updated) {
+            printf("Successfully updated file %s in filesystem\n", job->filename);
+            printf("Rewrote %" PRIu64 " of %" PRIu64 " data blocks of inode %u\n", job->rewritten,
+                   (job->size + BS - 1) / BS, job->inode_no);
+            added++;
+            continue;
+        }
+        printf("Successfully added file %s to filesystem\n", job->filename);
+        if (job->linked) {
+            printf("Linked to inode %u, which has the same content\n", job->inode_no);
+            added++;
+            continue;
+        }
+        printf("Used inode %u and %" PRIu64 " data blocks\n", job->inode_no,
+               job->data_blocks + job->map_blocks - job->shared - job->holes);
+        if (job->shared > 0) {
+            printf("Shared %" PRIu64 " duplicate blocks with existing files\n", job->shared);
+        }
+        if (job->holes > 0) {
+            printf("Left %" PRIu64 " blocks of holes and zeros unallocated\n", job->holes);
+        }
+        added++;
+    }
+
+    // Update root directory, superblock timestamp and checksum
+    ingest_commit(&ing);
+    ingest_destroy(&ing);
+    t0 = stats_now();
+    int closed = fs_close(&fs);
+    stats_phase_end(PHASE_CLOSE, t0);
+    if (closed != 0) {
+        return -1;
+    }
+    return added == file_count ? 0 : -1;
+}
+
+// Where an extracted file goes: into dest if it is a directory (or several
+// files are extracted), otherwise to dest itself
+void extract_dest_path(char* out, size_t out_size, const char* dest, const char* name, int several) {
+    struct stat st;
+    if (several || (stat(dest, &st) == 0 && S_ISDIR(st.st_mode))) {
+        snprintf(out, out_size, "%s/%s", dest, name);
+    } else {
+        snprintf(out, out_size, "%s", dest);
+    }
+}
+
+// Copy files out of the root directory on jobs workers
+int extract_files_from_filesystem(const char* input_path, char** names, int name_count, const char* dest, int jobs) {
+    fs_image_t fs;
+    uint64_t t0 = stats_now();
+    if (fs_open(&fs, input_path, NULL, 0) != 0) {
+        return -1;
+    }
+    stats_phase_end(PHASE_OPEN, t0);
+
+    ws_pool_t pool;
+    bufpool_t buffers;
+    bufpool_init(&buffers, EXTRACT_SCRATCH_BYTES, 0);
+    extract_job_t* extract_jobs = calloc((size_t)name_count, sizeof(extract_job_t));
+    if (!extract_jobs || ws_init(&pool, (unsigned)(jobs < name_count ? jobs : name_count)) != 0) {
+        perror("Memory allocation failed");
+        free(extract_jobs);
+        bufpool_destroy(&buffers);
+        fs_close(&fs);
+        return -1;
+    }
+    for (int i = 0; i < name_count; i++) {
+        char path[PATH_MAX];
+        extract_dest_path(path, sizeof(path), dest, names[i], name_count > 1);
+        extract_job_init(&extract_jobs[i], &fs, &buffers, names[i], path);
+        if (ws_push(&pool, batch_extract_task, &extract_jobs[i], 0, 0) != 0) {
+            extract_fail(&extract_jobs[i], "Memory allocation failed", ENOMEM);
+        }
+    }
+    ws_run(&pool);
+    ws_destroy(&pool);
+    bufpool_destroy(&buffers);
+
+    int extracted = 0;
+    for (int i = 0; i < name_count; i++) {
+        extract_job_t* job = &extract_jobs[i];
+        if (job->failed) {
+            errno = job->err_no;
+            perror(job->err);
+            continue;
+        }
+        printf("Extracted %s to %s (%" PRIu64 " bytes)\n", job->name, job->dest, job->inode->size_bytes);
+        extracted++;
+    }
+    free(extract_jobs);
+    t0 = stats_now();
+    int closed = fs_close(&fs);
+    stats_phase_end(PHASE_CLOSE, t0);
+    if (closed != 0) {
+        return -1;
+    }
+    return extracted == name_count ? 0 : -1;
+}
+
+// One host file seen by --sync
+typedef struct {
+    char* path;
+    const char* name;         // within path
+    struct stat st;
+} sync_entry_t;
+
+int compare_sync_entries(const void* a, const void* b) {
+    return strcmp(((const sync_entry_t*)a)->name, ((const sync_entry_t*)b)->name);
+}
+
+// Regular files at the top of a host directory, sorted by name
+int sync_scan(const char* dir_path, sync_entry_t** out, int* count_out) {
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        perror("Cannot open directory to sync");
+        return -1;
+    }
+    sync_entry_t* entries = NULL;
+    int count = 0, cap = 0;
+    struct dirent* de;
+    int rc = 0;
+    while (rc == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        char path[PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dir_path, de->d_name) >= (int)sizeof(path) || lstat(path, &st) != 0) {
+            fprintf(stderr, "Cannot access file to sync: %s/%s\n", dir_path, de->d_name);
+            rc = -1;
+            break;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "Skipping %s: not a regular file\n", path);
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            sync_entry_t* grown = realloc(entries, (size_t)cap * sizeof(sync_entry_t));
+            if (!grown) {
+                perror("Memory allocation failed");
+                rc = -1;
+                break;
+            }
+            entries = grown;
+        }
+        entries[count].path = strdup(path);
+        if (!entries[count].path) {
+            perror("Memory allocation failed");
+            rc = -1;
+            break;
+        }
+        entries[count].name = entries[count].path + strlen(dir_path) + 1;
+        entries[count].st = st;
+        count++;
+    }
+    closedir(dir);
+    if (rc != 0) {
+        for (int i = 0; i < count; i++) {
+            free(entries[i].path);
+        }
+        free(entries);
+        return -1;
+    }
+    qsort(entries, (size_t)count, sizeof(sync_entry_t), compare_sync_entries);
+    *out = entries;
+    *count_out = count;
+    return 0;
+}
+
+// crc32 of a host file
+int host_file_crc(const char* path, uint64_t size, uint8_t* buf, uint32_t* out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    uint32_t crc = 0;
+    for (uint64_t off = 0; off < size; off += PIPELINE_CHUNK_BLOCKS * BS) {
+        uint64_t len = size - off < PIPELINE_CHUNK_BLOCKS * BS ? size - off : PIPELINE_CHUNK_BLOCKS * BS;
+        if (read_chunk(fd, buf, off, len) != 0) {
+            close(fd);
+            return -1;
+        }
+        crc = crc32_update(crc, buf, len);
+    }
+    close(fd);
+    *out = crc;
+    return 0;
+}
+
+// Whether a host file holds exactly the bytes of a stored file
+int sync_same_content(const fs_image_t* fs, const inode_t* ino, const char* path, uint8_t* buf) {
+    // host data, then what the image holds, then inode_read scratch
+    const uint64_t step = (PIPELINE_CHUNK_BLOCKS * BS - INODE_READ_SCRATCH_BYTES) / 2;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    int same = 1;
+    for (uint64_t off = 0; same && off < ino->size_bytes; off += step) {
+        uint64_t len = ino->size_bytes - off < step ? ino->size_bytes - off : step;
+        same = read_chunk(fd, buf, off, len) == 0 &&
+               inode_read(fs, ino, off, buf + step, len, buf + 2 * step) == 0 && memcmp(buf, buf + step, len) == 0;
+    }
+    close(fd);
+    return same;
+}
+
+// Whether a stored file already matches its host copy: same size and mtime,
+// and with checksum, a stored crc32 equal to the host file's. An inode linked
+// from other names (--dedup-files) has one mtime for all of them, so it is
+// compared byte for byte instead.
+int sync_unchanged(const fs_image_t* fs, const inode_t* ino, const sync_entry_t* e, int checksum, uint8_t* buf) {
+    if (ino->size_bytes != (uint64_t)e->st.st_size) {
+        return 0;
+    }
+    if (ino->links > 1) {
+        return sync_same_content(fs, ino, e->path, buf);
+    }
+    if (ino->mtime != (uint64_t)e->st.st_mtime) {
+        return 0;
+    }
+    if (!checksum) {
+        return 1;
+    }
+    uint32_t crc;
+    return (ino->flags & INODE_FLAG_DATA_CRC) && host_file_crc(e->path, ino->size_bytes, buf, &crc) == 0 &&
+           crc == ino->data_crc;
+}
+
+// Mirror the regular files at the top of a host directory into the root
+// directory: names the host no longer has are removed, new ones added and
+// changed ones updated (--update), all in one session with one commit. A
+// file whose size and mtime match its inode (and with checksum, its stored
+// crc32) is not read, so a sync costs what changed plus one pass over the
+// names. A changed name whose inode other names share is unlinked and added
+// again, so the other names keep their content.
+int sync_files_to_filesystem(const char* input_path, const char* output_path, const char* dir_path, int checksum,
+                             int jobs, int huge_pages, int dedup, int dedup_files, int compress) {
+    sync_entry_t* host;
+    int host_count;
+    if (sync_scan(dir_path, &host, &host_count) != 0) {
+        return -1;
+    }
+    fs_image_t fs;
+    uint64_t t0 = stats_now();
+    int opened = fs_open(&fs, input_path, output_path, huge_pages) == 0;
+    if (!opened || (dedup && dedup_enable(&fs) != 0)) {
+        if (opened) {
+            fs_close(&fs);
+        }
+        for (int i = 0; i < host_count; i++) {
+            free(host[i].path);
+        }
+        free(host);
+        return -1;
+    }
+    stats_phase_end(PHASE_OPEN, t0);
+    int failed = 0;
+
+    // Remove what the host no longer has. Removing leaves a tombstone in
+    // place, so the scan of the directory carries on undisturbed.
+    inode_t* root = fs_inode(&fs, ROOT_INO);
+    int removed = 0;
+    for (uint64_t b = 0; b < root->size_bytes / BS; b++) {
+        dirent64_t* entries = dir_block_entries(&fs, root, b);
+        for (uint32_t i = (b == 0 ? 2 : 0); entries && i < DIRENTS_PER_BLOCK; i++) {
+            sync_entry_t key = { NULL, entries[i].name, { 0 } };
+            if (entries[i].inode_no == 0 || entries[i].type != 1 ||
+                bsearch(&key, host, (size_t)host_count, sizeof(sync_entry_t), compare_sync_entries)) {
+                continue;
+            }
+            char name[sizeof(entries[i].name)];
+            const char* err;
+            uint64_t blocks;
+            strcpy(name, entries[i].name);
+            if (fs_remove_file(&fs, name, NULL, &blocks, &err) != 0) {
+                perror(err);
+                failed++;
+                continue;
+            }
+            printf("Removed %s\n", name);
+            removed++;
+        }
+    }
+
+    ingest_t ing;
+    ingest_init(&ing, &fs, huge_pages);
+    ing.dedup_files = dedup_files;
+    ing.compress = compress;
+    ing.update = 1;
+
+    // Queue the new and changed files
+    uint8_t* buf = bufpool_get(&ing.buffers);
+    add_job_t* add_jobs = arena_alloc(&ing.arena, (size_t)(host_count + 1) * sizeof(add_job_t));
+    int* origin = arena_alloc(&ing.arena, (size_t)(host_count + 1) * sizeof(int));
+    uint8_t* replaced = arena_alloc(&ing.arena, (size_t)(host_count + 1)); // unlinked from a shared inode
+    ws_pool_t pool;
+    int pool_up = buf && add_jobs && origin && replaced && ws_init(&pool, (unsigned)jobs) == 0;
+    if (!pool_up) {
+        perror("Memory allocation failed");
+        if (buf) {
+            bufpool_put(&ing.buffers, buf);
+        }
+        failed++;
+    }
+    int queued = 0, unchanged = 0;
+    for (int i = 0; pool_up && i < host_count; i++) {
+        const dirent64_t* de = dir_lookup(&fs, root, host[i].name);
+        if (de && de->type != 1) {
+            fprintf(stderr, "Skipping %s: a directory has that name\n", host[i].path);
+            continue;
+        }
+        if (de && sync_unchanged(&fs, fs_inode(&fs, de->inode_no), &host[i], checksum, buf)) {
+            unchanged++;
+            continue;
+        }
+        replaced[queued] = 0;
+        if (de && fs_inode(&fs, de->inode_no)->links > 1) {
+            const char* err;
+            uint64_t blocks;
+            if (fs_remove_file(&fs, host[i].name, NULL, &blocks, &err) != 0) {
+                fprintf(stderr, "%s: ", host[i].path);
+                perror(err);
+                failed++;
+                continue;
+            }
+            ing.root_entries = fs.ext->root_entries; // nothing is queued to reserve yet
+            replaced[queued] = 1;
+        }
+        add_job_init(&add_jobs[queued], &ing, host[i].path);
+        origin[queued] = i;
+        if (ws_push(&pool, batch_add_task, &add_jobs[queued], 0, 0) != 0) {
+            add_fail(&add_jobs[queued], "Memory allocation failed", ENOMEM);
+        }
+        queued++;
+    }
+    if (pool_up) {
+        bufpool_put(&ing.buffers, buf);
+        ws_run(&pool);
+        ws_destroy(&pool);
+    }
+
+    // Stamp what was written with the host mtime (and crc32), so the next
+    // sync sees it as unchanged
+    int added = 0, updated = 0;
+    buf = checksum ? bufpool_get(&ing.buffers) : NULL; // inode_read scratch for the crc32s
+    for (int q = 0; q < queued; q++) {
+        add_job_t* job = &add_jobs[q];
+        if (job->failed) {
+            errno = job->err_no;
+            fprintf(stderr, "%s: ", host[origin[q]].path);
+            perror(job->err);
+            failed++;
+            continue;
+        }
+        printf("%s %s\n", job->updated || replaced[q] ? "Updated" : "Added", job->filename);
+        if (job->updated || replaced[q]) {
+            updated++;
+        } else {
+            added++;
+        }
+        if (job->linked) {
+            continue; // the inode belongs to another name too
+        }
+        inode_t* ino = fs_inode(&fs, job->inode_no);
+        ino->mtime = (uint64_t)host[origin[q]].st.st_mtime;
+        if (buf && !(ino->flags & INODE_FLAG_DATA_CRC) && inode_data_crc(&fs, ino, &ino->data_crc, buf) == 0) {
+            ino->flags |= INODE_FLAG_DATA_CRC; // not already known from the copy or the update
+        }
+        inode_checksum(ino);
+    }
+    if (buf) {
+        bufpool_put(&ing.buffers, buf);
+    }
+    printf("Synced %s: %d added, %d updated, %d removed, %d unchanged\n", dir_path, added, updated, removed,
+           unchanged);
+
+    ingest_commit(&ing);
+    ingest_destroy(&ing);
+    for (int i = 0; i < host_count; i++) {
+        free(host[i].path);
+    }
+    free(host);
+    t0 = stats_now();
+    int closed = fs_close(&fs);
+    stats_phase_end(PHASE_CLOSE, t0);
+    return closed == 0 && failed == 0 ? 0 : -1;
+}
+
+// =================================DAEMON MODE==================================
+// A long-running adder: the image stays mapped and clients send one request
+// per line over a Unix socket:
+//   ADD <path>                -> OK <inode>
+//   LIST                      -> OK <count>, then "<inode> <size> <name>" lines
+//   EXTRACT <name>\t<path>    -> OK <size>
+// Failures reply "ERR <reason>". Requests may be pipelined. Adds are committed
+// (superblock checksum + msync) in groups: after batch_count adds, once the
+// oldest is batch_ms old, or as soon as no more requests are waiting. Replies
+// are held until the adds before them are committed.
+
+typedef struct {
+    int fd;
+    char* in;
+    size_t in_len, in_cap;
+    char* out;
+    size_t out_len, out_cap;
+    size_t out_sent;
+    size_t out_ready;         // bytes that may be sent (everything before it is committed)
+    int eof;
+} client_t;
+
+volatile sig_atomic_t g_stop = 0;
+
+void handle_stop_signal(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+int buf_append(char** buf, size_t* len, size_t* cap, const char* data, size_t n) {
+    if (*len + n > *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 4096;
+        while (new_cap < *len + n) {
+            new_cap *= 2;
+        }
+        char* p = realloc(*buf, new_cap);
+        if (!p) {
+            return -1;
+        }
+        *buf = p;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+int client_reply(client_t* c, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+int client_reply(client_t* c, const char* fmt, ...) {
+    char line[DAEMON_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return -1;
+    }
+    if ((size_t)n >= sizeof(line)) {
+        n = sizeof(line) - 1;
+    }
+    return buf_append(&c->out, &c->out_len, &c->out_cap, line, (size_t)n);
+}
+
+void handle_list(const ingest_t* ing, client_t* c) {
+    const fs_image_t* fs = ing->fs;
+    const inode_t* root = fs_inode(fs, ROOT_INO);
+    uint64_t dir_blocks = root->size_bytes / BS;
+
+    client_reply(c, "OK %" PRIu64 "\n", ing->root_entries);
+    for (uint64_t b = 0; b < dir_blocks; b++) {
+        dirent64_t* entries = dir_block_entries(fs, root, b);
+        for (uint32_t i = (b == 0 ? 2 : 0); entries && i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inode_no != 0) {
+                client_reply(c, "%u %" PRIu64 " %s\n", entries[i].inode_no,
+                             fs_inode(fs, entries[i].inode_no)->size_bytes, entries[i].name);
+            }
+        }
+    }
+}
+
+// Statistics so far as one JSON line (the daemon runs with --stats=json)
+void handle_stats(client_t* c) {
+    if (!g_stats.enabled) {
+        client_reply(c, "ERR Statistics are off (start the daemon with --stats=json)\n");
+        return;
+    }
+    char* json = NULL;
+    size_t json_len = 0;
+    FILE* out = open_memstream(&json, &json_len);
+    if (!out) {
+        client_reply(c, "ERR Memory allocation failed\n");
+        return;
+    }
+    stats_print_json(out, "mkfs_adder");
+    fclose(out);
+    if (buf_append(&c->out, &c->out_len, &c->out_cap, "OK ", 3) != 0 ||
+        buf_append(&c->out, &c->out_len, &c->out_cap, json, json_len) != 0) {
+        c->out_len = 0; // a partial reply would desynchronise the client
+    }
+    free(json);
+}
+
+// Returns 1 if the request added a file (and so needs a commit)
+int handle_request(ingest_t* ing, client_t* c, char* line) {
+    const char* err;
+
+    if (strncmp(line, "ADD ", 4) == 0) {
+        uint32_t inode_no;
+        uint64_t blocks;
+        if (fs_add_file(ing, line + 4, &inode_no, &blocks, &err) != 0) {
+            client_reply(c, "ERR %s\n", err);
+            return 0;
+        }
+        client_reply(c, "OK %u\n", inode_no);
+        return 1;
+    }
+    if (strcmp(line, "LIST") == 0) {
+        handle_list(ing, c);
+        return 0;
+    }
+    if (strcmp(line, "STATS") == 0) {
+        handle_stats(c);
+        return 0;
+    }
+    if (strncmp(line, "EXTRACT ", 8) == 0) {
+        char* dest = strchr(line + 8, '\t');
+        uint64_t size;
+        if (!dest) {
+            client_reply(c, "ERR Malformed EXTRACT request\n");
+            return 0;
+        }
+        *dest++ = '\0';
+        if (fs_extract_file(ing->fs, &ing->buffers, line + 8, dest, &size, &err) != 0) {
+            client_reply(c, "ERR %s\n", err);
+        } else {
+            client_reply(c, "OK %" PRIu64 "\n", size);
+        }
+        return 0;
+    }
+    client_reply(c, "ERR Unknown request\n");
+    return 0;
+}
+
+// Handle every complete line buffered for a client; returns the number of adds
+int client_process(ingest_t* ing, client_t* c, int* pending) {
+    size_t start = 0;
+    int adds = 0;
+
+    for (size_t i = 0; i < c->in_len; i++) {
+        if (c->in[i] != '\n') {
+            continue;
+        }
+        c->in[i] = '\0';
+        int added = handle_request(ing, c, c->in + start);
+        adds += added;
+        *pending += added;
+        if (*pending == 0) {
+            c->out_ready = c->out_len; // nothing uncommitted before this reply
+        }
+        start = i + 1;
+    }
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+    return adds;
+}
+
+void client_close(client_t* c) {
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+int daemon_listen(const char* socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Cannot create daemon socket");
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        perror("Cannot listen on daemon socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int run_daemon(const char* input_path, const char* output_path, const char* socket_path, int batch_count, int batch_ms,
+               int huge_pages, int dedup, int dedup_files, int compress, int update, int append) {
+    fs_image_t fs;
+    uint64_t t0 = stats_now();
+    if (fs_open(&fs, input_path, output_path, huge_pages) != 0) {
+        return -1;
+    }
+    if (dedup && dedup_enable(&fs) != 0) {
+        fs_close(&fs);
+        return -1;
+    }
+    stats_phase_end(PHASE_OPEN, t0);
+    int listen_fd = daemon_listen(socket_path);
+    if (listen_fd < 0) {
+        fs_close(&fs);
+        return -1;
+    }
+    ingest_t ing;
+    ingest_init(&ing, &fs, huge_pages);
+    ing.dedup_files = dedup_files;
+    ing.compress = compress;
+    ing.update = update;
+    ing.append = append;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_stop_signal);
+    signal(SIGTERM, handle_stop_signal);
+    printf("Serving %s on %s\n", output_path ? output_path : input_path, socket_path);
+    fflush(stdout);
+
+    client_t* clients = NULL;
+    int client_count = 0;
+    struct pollfd* pfds = NULL;
+    int pfd_cap = 0;
+    int pending = 0;              // adds applied but not committed yet
+    uint64_t pending_since = 0;
+    int rc = 0;
+
+    while (!g_stop) {
+        if (client_count + 1 > pfd_cap) {
+            int cap = pfd_cap ? pfd_cap * 2 : 16;
+            struct pollfd* p = realloc(pfds, (size_t)cap * sizeof(struct pollfd));
+            if (!p) {
+                perror("Memory allocation failed");
+                rc = -1;
+                break;
+            }
+            pfds = p;
+            pfd_cap = cap;
+        }
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        for (int i = 0; i < client_count; i++) {
+            pfds[i + 1].fd = clients[i].fd;
+            pfds[i + 1].events = (clients[i].eof ? 0 : POLLIN) | (clients[i].out_ready > clients[i].out_sent ? POLLOUT : 0);
+        }
+
+        // With uncommitted adds, only look for requests that are already queued
+        int polled = client_count;
+        int ready = poll(pfds, (nfds_t)(polled + 1), pending > 0 ? 0 : -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            rc = -1;
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                client_t* cl = realloc(clients, (size_t)(client_count + 1) * sizeof(client_t));
+                if (!cl) {
+                    close(fd);
+                    break;
+                }
+                clients = cl;
+                memset(&clients[client_count], 0, sizeof(client_t));
+                clients[client_count++].fd = fd;
+            }
+        }
+
+        int got_input = 0;
+        for (int i = 0; i < polled; i++) {
+            client_t* c = &clients[i];
+            if (!(pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            char buf[65536];
+            ssize_t n = read(c->fd, buf, sizeof(buf));
+            if (n > 0) {
+                if (buf_append(&c->in, &c->in_len, &c->in_cap, buf, (size_t)n) != 0) {
+                    c->eof = 1;
+                }
+                int before = pending;
+                client_process(&ing, c, &pending);
+                if (before == 0 && pending > 0) {
+                    pending_since = monotonic_ms();
+                }
+                got_input = 1;
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                c->eof = 1;
+            }
+        }
+
+        // Group commit: on the count or time threshold, or once the queue is drained
+        if (pending > 0 && (pending >= batch_count || !got_input ||
+                            monotonic_ms() - pending_since >= (uint64_t)batch_ms)) {
+            ingest_commit(&ing);
+            if (msync(fs.img_data, fs.img_size, MS_SYNC) != 0) {
+                perror("Failed to sync image");
+            }
+            pending = 0;
+            for (int i = 0; i < client_count; i++) {
+                clients[i].out_ready = clients[i].out_len;
+            }
+        }
+
+        for (int i = 0; i < client_count; i++) {
+            client_t* c = &clients[i];
+            while (c->out_sent < c->out_ready) {
+                ssize_t n = write(c->fd, c->out + c->out_sent, c->out_ready - c->out_sent);
+                if (n <= 0) {
+                    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                        c->eof = 1;
+                        c->out_sent = c->out_ready = c->out_len = 0;
+                    }
+                    break;
+                }
+                c->out_sent += (size_t)n;
+            }
+            if (c->out_sent == c->out_len) {
+                c->out_sent = c->out_ready = c->out_len = 0;
+            }
+            if (c->eof && c->out_len == 0) {
+                client_close(c);
+                clients[i] = clients[--client_count];
+                i--;
+            }
+        }
+    }
+
+    if (pending > 0) {
+        ingest_commit(&ing);
+    }
+    ingest_destroy(&ing);
+    for (int i = 0; i < client_count; i++) {
+        client_close(&clients[i]);
+    }
+    free(clients);
+    free(pfds);
+    close(listen_fd);
+    unlink(socket_path);
+    t0 = stats_now();
+    if (fs_close(&fs) != 0) {
+        rc = -1;
+    }
+    stats_phase_end(PHASE_CLOSE, t0);
+    return rc;
+}
+
+// =================================CLIENT MODE==================================
+
+int client_connect(const char* socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("Cannot connect to daemon");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Send every request up front (pipelined), then read the replies in order
+int run_client(const adder_args_t* args) {
+    int fd = client_connect(args->connect_socket);
+    if (fd < 0) {
+        return -1;
+    }
+
+    char* req = NULL;
+    size_t req_len = 0, req_cap = 0;
+    char line[DAEMON_LINE_MAX];
+    int rc = 0;
+
+    if (args->list) {
+        rc = buf_append(&req, &req_len, &req_cap, "LIST\n", 5);
+    }
+    if (args->stats) {
+        rc = buf_append(&req, &req_len, &req_cap, "STATS\n", 6);
+    }
+    for (int i = 0; rc == 0 && i < args->extract_count; i++) {
+        char path[PATH_MAX], dest[PATH_MAX];
+        extract_dest_path(path, sizeof(path), args->extract_to, args->extracts[i], args->extract_count > 1);
+        // the daemon runs elsewhere, so send an absolute destination
+        if (path[0] == '/' || !getcwd(dest, sizeof(dest))) {
+            snprintf(dest, sizeof(dest), "%s", path);
+        } else {
+            size_t used = strlen(dest);
+            if ((size_t)snprintf(dest + used, sizeof(dest) - used, "/%s", path) >= sizeof(dest) - used) {
+                errno = ENAMETOOLONG;
+                rc = -1;
+                break;
+            }
+        }
+        int n = snprintf(line, sizeof(line), "EXTRACT %s\t%s\n", args->extracts[i], dest);
+        rc = buf_append(&req, &req_len, &req_cap, line, (size_t)n);
+    }
+    for (int i = 0; rc == 0 && i < args->file_count; i++) {
+        char path[PATH_MAX];
+        if (!realpath(args->files[i], path)) {
+            snprintf(path, sizeof(path), "%s", args->files[i]);
+        }
+        int n = snprintf(line, sizeof(line), "ADD %s\n", path);
+        rc = buf_append(&req, &req_len, &req_cap, line, (size_t)n);
+    }
+    if (rc != 0 || write_all(fd, req, req_len) != 0) {
+        perror("Failed to send requests");
+        free(req);
+        close(fd);
+        return -1;
+    }
+    free(req);
+    shutdown(fd, SHUT_WR);
+
+    FILE* in = fdopen(fd, "r");
+    if (!in) {
+        close(fd);
+        return -1;
+    }
+    if (args->stats) {
+        // one JSON line, longer than a normal reply
+        char* reply = NULL;
+        size_t reply_cap = 0;
+        if (getline(&reply, &reply_cap, in) < 0 || strncmp(reply, "OK ", 3) != 0) {
+            fputs(reply ? reply : "ERR No reply from daemon\n", stdout);
+            rc = -1;
+        } else {
+            fputs(reply + 3, stdout);
+        }
+        free(reply);
+        fclose(in);
+        return rc;
+    }
+    int expected = args->list ? 1 : args->file_count + args->extract_count;
+    for (int i = 0; i < expected && fgets(line, sizeof(line), in); i++) {
+        if (strncmp(line, "ERR", 3) == 0) {
+            rc = -1;
+        }
+        if (args->file_count > 0) {
+            printf("%s: %s", args->files[i], line);
+        } else if (args->extract_count > 0) {
+            printf("%s: %s", args->extracts[i], line);
+        } else {
+            fputs(line, stdout);
+        }
+        // a LIST reply is followed by one line per entry
+        unsigned long long entries;
+        if (args->list && sscanf(line, "OK %llu", &entries) == 1) {
+            for (unsigned long long e = 0; e < entries && fgets(line, sizeof(line), in); e++) {
+                fputs(line, stdout);
+            }
+        }
+    }
+    fclose(in);
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+    
+    adder_args_t args;
+    if (parse_args(argc, argv, &args) != 0) {
+        print_usage(argv[0]);
+        free(args.files);
+        free(args.extracts);
+        return 1;
+    }
+
+    FILE* stats_out = NULL;
+    if (args.stats && !args.connect_socket) {
+        stats_enable(ADD_PHASE_NAMES, ADD_PHASES);
+        stats_out = stats_claim_stdout();
+    }
+    int rc;
+    if (args.connect_socket) {
+        rc = run_client(&args);
+    } else if (args.daemon_socket) {
+        rc = run_daemon(args.input_path, args.output_path, args.daemon_socket, args.batch_count, args.batch_ms, args.huge_pages,
+                        args.dedup, args.dedup_files, args.compress, args.update, args.append);
+    } else if (args.sync_dir) {
+        rc = sync_files_to_filesystem(args.input_path, args.output_path, args.sync_dir, args.checksum, args.jobs,
+                                      args.huge_pages, args.dedup, args.dedup_files, args.compress);
+    } else if (args.extract_count > 0) {
+        rc = extract_files_from_filesystem(args.input_path, args.extracts, args.extract_count, args.extract_to, args.jobs);
+    } else {
+        rc = add_files_to_filesystem(args.input_path, args.output_path, args.files, args.file_count, args.jobs, args.huge_pages,
+                                     args.dedup, args.dedup_files, args.compress, args.update, args.append);
+    }
+    if (stats_out) {
+        stats_print_json(stats_out, "mkfs_adder");
+    }
+    free(args.files);
+    free(args.extracts);
+    
+    return rc == 0 ? 0 : 1;
+}
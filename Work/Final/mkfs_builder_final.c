@@ -1,137 +1,178 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_minivsfs.c -o mkfs_builder
-#define _FILE_OFFSET_BITS 64
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <inttypes.h>
-#include <errno.h>
-#include <time.h>
-#include <assert.h>
-
-#define BS 4096u               // block size
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-
-uint64_t g_random_seed = 0; // This should be replaced by seed value from the CLI.
-
-// below contains some basic structures you need for your project
-// you are free to create more structures as you require
-
-#pragma pack(push, 1)
-typedef struct {
-    // CREATE YOUR SUPERBLOCK HERE
-    // ADD ALL FIELDS AS PROVIDED BY THE SPECIFICATION
-    uint32_t magic;               
-    uint32_t version;            
-    uint32_t block_size;          
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;        
-    uint64_t mtime_epoch;         
-    uint32_t flags;
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint32_t checksum;            // crc32(superblock[0..4091])
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    // CREATE YOUR INODE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-    uint16_t mode;                
-    uint16_t links;              
-    uint32_t uid;                 
-    uint32_t gid;                 
-    uint64_t size_bytes;          
-    uint64_t atime;              
-    uint64_t mtime;               
-    uint64_t ctime;               
-    uint32_t direct[12];  
-    uint32_t reserved_0;          
-    uint32_t reserved_1;          
-    uint32_t reserved_2;          
-    uint32_t proj_id;             // group ID
-    uint32_t uid16_gid16;        
-    uint64_t xattr_ptr; 
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint64_t inode_crc;   // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
-
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_builder_final.c -o mkfs_builder
+#include "minivsfs.h"
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define POPULATE_CHUNK_BLOCKS 256u   // 1 MiB read unit for the populate workers
+
+// Phases timed by --stats=json
+enum { PHASE_SCAN, PHASE_METADATA, PHASE_DATA, PHASE_SIZE, PHASE_CLOSE, BUILD_PHASES };
+static const char* const BUILD_PHASE_NAMES[BUILD_PHASES] = {
+    "scan", "metadata", "data", "size", "close",
+};
+
+uint64_t g_random_seed = 0; // set with --seed; drives the --generate workloads
+
+// Synthetic corpora for benchmarks (--generate): file sizes follow one of the
+// distributions below, and sizes and contents all come from g_random_seed,
+// so a seed always produces the same corpus.
+enum { WORKLOAD_TINY, WORKLOAD_LOGNORMAL, WORKLOAD_BIMODAL };
+static const char* const WORKLOAD_NAMES[] = {"tiny", "lognormal", "bimodal"};
+
+#define GEN_TINY_MAX 4096u                    // tiny: 0 .. 1 block
+#define GEN_LOGNORMAL_MEDIAN_LOG2 15          // lognormal: median 32 KiB...
+#define GEN_LOGNORMAL_SIGMA_LOG2 2.0          // ...one sigma is a factor of 4
+#define GEN_LOGNORMAL_MAX (256u << 20)
+#define GEN_BIMODAL_HUGE_PCT 3u               // bimodal: 3% of files are huge
+#define GEN_BIMODAL_SMALL_MAX (16u << 10)
+#define GEN_BIMODAL_HUGE_MIN (16u << 20)
+#define GEN_BIMODAL_HUGE_MAX (64u << 20)
+
 typedef struct {
-    // CREATE YOUR DIRECTORY ENTRY STRUCTURE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-    uint32_t inode_no;           
-    uint8_t type;                 
-    char name[58];
-    uint8_t  checksum; // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+    char* dir;
+    int workload;
+    uint64_t files;           // stop after this many files...
+    uint64_t total_kib;       // ...or once this much data is written (0 for no limit)
+} gen_spec_t;
 
+// splitmix64 over g_random_seed
+uint64_t random_next(void) {
+    uint64_t z = (g_random_seed += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+double random_unit(void) {
+    return (double)(random_next() >> 11) / (double)(1ull << 53);
+}
 
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+// Standard normal, as the sum of twelve uniforms (good to about 6 sigma)
+double random_normal(void) {
+    double sum = 0;
+    for (int i = 0; i < 12; i++) {
+        sum += random_unit();
     }
+    return sum - 6.0;
 }
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
+
+// 2^x without libm: shift for the integer part, series for the fraction
+double pow2(double x) {
+    int whole = (int)x - (x < (int)x);
+    double f = (x - whole) * 0.6931471805599453; // ln 2
+    double term = 1, sum = 1;
+    for (int k = 1; k < 12; k++) {
+        term *= f / k;
+        sum += term;
+    }
+    for (; whole > 0; whole--) {
+        sum *= 2;
+    }
+    for (; whole < 0; whole++) {
+        sum /= 2;
+    }
+    return sum;
 }
-// ====================================CRC32====================================
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
+uint64_t random_file_size(int workload) {
+    switch (workload) {
+    case WORKLOAD_TINY:
+        return random_next() % (GEN_TINY_MAX + 1);
+    case WORKLOAD_LOGNORMAL: {
+        double size = pow2(GEN_LOGNORMAL_MEDIAN_LOG2 + GEN_LOGNORMAL_SIGMA_LOG2 * random_normal());
+        return size < GEN_LOGNORMAL_MAX ? (uint64_t)size : GEN_LOGNORMAL_MAX;
+    }
+    default:
+        if (random_next() % 100 < GEN_BIMODAL_HUGE_PCT) {
+            return GEN_BIMODAL_HUGE_MIN + random_next() % (GEN_BIMODAL_HUGE_MAX - GEN_BIMODAL_HUGE_MIN + 1);
+        }
+        return random_next() % (GEN_BIMODAL_SMALL_MAX + 1);
+    }
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+// Write the corpus described by spec into spec->dir, as files s<seed>_0000000,
+// s<seed>_0000001, ... so corpora from different seeds can share an image
+int generate_workload(const gen_spec_t* spec) {
+    uint64_t seed = g_random_seed;
+    if (mkdir(spec->dir, 0755) != 0 && errno != EEXIST) {
+        perror("Cannot create workload directory");
+        return -1;
+    }
+    size_t buf_size = 1u << 20;
+    uint64_t* buf = malloc(buf_size);
+    if (!buf) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    uint64_t files = 0, total = 0;
+    int rc = 0;
+    for (; rc == 0 && files < spec->files; files++) {
+        uint64_t size = random_file_size(spec->workload);
+        if (spec->total_kib && total + size > spec->total_kib * 1024) {
+            break;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/s%" PRIu64 "_%07" PRIu64, spec->dir, seed, files);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("Cannot create workload file");
+            rc = -1;
+            break;
+        }
+        for (uint64_t done = 0; rc == 0 && done < size;) {
+            size_t len = size - done < buf_size ? (size_t)(size - done) : buf_size;
+            for (size_t w = 0; w < (len + 7) / 8; w++) {
+                buf[w] = random_next();
+            }
+            if (write(fd, buf, len) != (ssize_t)len) {
+                perror("Failed to write workload file");
+                rc = -1;
+            }
+            done += len;
+        }
+        if (close(fd) != 0) {
+            rc = -1;
+        }
+        total += size;
+    }
+    free(buf);
+    if (rc == 0) {
+        printf("Generated %" PRIu64 " %s files (%" PRIu64 " bytes) in %s\n", files, WORKLOAD_NAMES[spec->workload],
+               total, spec->dir);
+    }
+    return rc;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
-    de->checksum = x;
+// Mark every inode table group from first_lazy on as not yet zeroed, so the
+// builder can skip writing them. Earlier groups hold the root (and any
+// populated) inodes and are written in full.
+void init_itable_uninit_markers(uint8_t* block0, superblock_t* sb, uint64_t first_lazy) {
+    uint64_t group_blocks = itable_group_blocks(sb->inode_table_blocks);
+    uint64_t groups = (sb->inode_table_blocks + group_blocks - 1) / group_blocks;
+    uint8_t* marks = block0 + ITABLE_UNINIT_OFFSET;
+
+    for (uint64_t g = first_lazy; g < groups; g++) {
+        marks[g / 8] |= (uint8_t)(1u << (g % 8));
+    }
+    if (groups > first_lazy) {
+        sb->flags |= SB_FLAG_LAZY_ITABLE;
+    }
 }
 
-int parse_args(int argc, char* argv[], char** image_path, uint64_t* size_kib, uint64_t* inode_count) {
+int parse_args(int argc, char* argv[], char** image_path, uint64_t* size_kib, uint64_t* inode_count,
+               int* preallocate, char** populate_dir, int* jobs, int* stats, gen_spec_t* gen) {
+    memset(gen, 0, sizeof(*gen));
+    gen->workload = WORKLOAD_LOGNORMAL;
+    gen->files = 1000;
     *image_path = NULL;
     *size_kib = 0;
     *inode_count = 0;
+    *preallocate = 0;
+    *populate_dir = NULL;
+    *jobs = 4;
+    *stats = 0;
     
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
@@ -140,38 +181,70 @@ int parse_args(int argc, char* argv[], char** image_path, uint64_t* size_kib, ui
             *size_kib = strtoull(argv[++i], NULL, 10);
         } else if (strcmp(argv[i], "--inodes") == 0 && i + 1 < argc) {
             *inode_count = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--preallocate") == 0) {
+            *preallocate = 1;
+        } else if (strcmp(argv[i], "--populate") == 0 && i + 1 < argc) {
+            *populate_dir = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            *jobs = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            if (strcmp(argv[i] + 8, "json") != 0) {
+                return -1;
+            }
+            *stats = 1;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            g_random_seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+            gen->dir = argv[++i];
+        } else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            gen->workload = -1;
+            for (int w = 0; w < (int)(sizeof(WORKLOAD_NAMES) / sizeof(WORKLOAD_NAMES[0])); w++) {
+                if (strcmp(name, WORKLOAD_NAMES[w]) == 0) {
+                    gen->workload = w;
+                }
+            }
+            if (gen->workload < 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+            gen->files = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--total-kib") == 0 && i + 1 < argc) {
+            gen->total_kib = strtoull(argv[++i], NULL, 10);
         }
     }
     
-    
-    if (!*image_path || *size_kib == 0 || *inode_count == 0) {
+    if (gen->dir) {
+        return *image_path ? -1 : 0; // generating a corpus builds no image
+    }
+    // With --populate the size and inode count default to exactly what the tree needs
+    if (!*image_path || *jobs < 1) {
+        return -1;
+    }
+    if (!*populate_dir && (*size_kib == 0 || *inode_count == 0)) {
         return -1; 
     }
     
     return 0; 
 }
-void init_superblock(superblock_t* sb, uint64_t total_blocks, uint64_t inode_count, time_t build_time) {
+int init_superblock(superblock_t* sb, uint64_t total_blocks, uint64_t inode_count, time_t build_time) {
     memset(sb, 0, sizeof(superblock_t));
     
-    sb->magic = 0x4D565346;
+    sb->magic = MAGIC;
     sb->version = 1;
     sb->block_size = BS;
     sb->total_blocks = total_blocks;
     sb->inode_count = inode_count;
     
-    
-    sb->inode_bitmap_start = 1;
-    sb->inode_bitmap_blocks = 1;
-    sb->data_bitmap_start = 2;
-    sb->data_bitmap_blocks = 1;
-    sb->inode_table_start = 3;
-    sb->inode_table_blocks = (inode_count * INODE_SIZE + BS - 1) / BS; //ceiling division
-    sb->data_region_start = 3 + sb->inode_table_blocks;
-    sb->data_region_blocks = total_blocks - sb->data_region_start;
+    // bitmap sizes, region placement and alignment depend on the size class
+    if (compute_layout(sb, total_blocks, inode_count) != 0) {
+        return -1;
+    }
     
     sb->root_inode = ROOT_INO;
     sb->mtime_epoch = (uint64_t)build_time;
     sb->flags = 0;
+    return 0;
 }
 void init_root_inode(inode_t* root_inode, time_t build_time, uint32_t proj_id) {
     memset(root_inode, 0, sizeof(inode_t));
@@ -191,127 +264,768 @@ void init_root_inode(inode_t* root_inode, time_t build_time, uint32_t proj_id) {
         root_inode->direct[i] = 0;
     }
     
-    root_inode->reserved_0 = 0;
-    root_inode->reserved_1 = 0;
-    root_inode->reserved_2 = 0;
+    root_inode->indirect = 0;
+    root_inode->double_indirect = 0;
+    root_inode->triple_indirect = 0;
     root_inode->proj_id = proj_id;
     root_inode->uid16_gid16 = 0;
-    root_inode->xattr_ptr = 0;
-}
-void init_root_directory_entries(dirent64_t* entries) {
-    // Entry for "."
-    memset(&entries[0], 0, sizeof(dirent64_t));
-    entries[0].inode_no = ROOT_INO;
-    entries[0].type = 2; // directory
-    strcpy(entries[0].name, ".");
-    
-    // Entry for ".."
-    memset(&entries[1], 0, sizeof(dirent64_t));
-    entries[1].inode_no = ROOT_INO;
-    entries[1].type = 2; // directory
-    strcpy(entries[1].name, "..");
-    
-   
-    for (int i = 2; i < BS / sizeof(dirent64_t); i++) {
-        memset(&entries[i], 0, sizeof(dirent64_t));
-        entries[i].inode_no = 0; // free entry
+    root_inode->data_crc = 0;
+}
+
+// ===================================POPULATE==================================
+// --populate walks a host directory tree, plans the whole layout up front
+// (inode numbers, directory sizes, contiguous data placement) and streams the
+// image out in one sequential pass. Source files are read by a worker pool
+// into a ring of chunk buffers ahead of the writer.
+
+typedef struct {
+    char* host_path;        // NULL for an empty root
+    char name[58];
+    int is_dir;
+    uint64_t size_bytes;
+    uint64_t mtime;
+    uint32_t parent;        // node index; the inode number is index + 1
+    uint32_t first_child;   // children are stored contiguously (BFS order)
+    uint32_t child_count;
+    uint64_t data_blocks;
+    uint64_t map_blocks;    // pointer blocks, placed right after the data blocks
+    uint64_t first_block;   // data region relative, 1-indexed
+} pop_node_t;
+
+typedef struct {
+    pop_node_t* nodes;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t used_blocks;   // data region blocks taken by the plan
+} pop_plan_t;
+
+// Number the pointer blocks for `*remaining` data blocks starting at *next_data,
+// pre-order from meta_base. With meta == NULL only the numbering is done.
+uint32_t plan_map_fill(uint32_t* meta, uint64_t* meta_used, uint64_t meta_base, int depth,
+                  uint64_t* next_data, uint64_t* remaining) {
+    uint64_t idx = (*meta_used)++;
+    uint32_t* ptrs = meta ? meta + idx * PTRS_PER_BLOCK : NULL;
+
+    for (uint32_t k = 0; k < PTRS_PER_BLOCK && *remaining > 0; k++) {
+        uint32_t p;
+        if (depth == 1) {
+            p = (uint32_t)(*next_data)++;
+            (*remaining)--;
+        } else {
+            p = plan_map_fill(meta, meta_used, meta_base, depth - 1, next_data, remaining);
+        }
+        if (ptrs) {
+            ptrs[k] = p;
+        }
     }
-    
-    // Finalize checksums
-    dirent_checksum_finalize(&entries[0]);
-    dirent_checksum_finalize(&entries[1]);
+    return (uint32_t)(meta_base + idx);
 }
 
+// Point the inode at data_blocks contiguous blocks from first_block, with its
+// pointer blocks following them. Returns how many pointer blocks that takes.
+uint64_t plan_block_map(inode_t* ino, uint32_t* meta, uint64_t first_block, uint64_t data_blocks) {
+    uint64_t next_data = first_block;
+    uint64_t remaining = data_blocks;
+    uint64_t meta_used = 0;
+    uint64_t meta_base = first_block + data_blocks;
+    uint32_t top[3] = {0, 0, 0};
 
+    for (int i = 0; i < DIRECT_MAX; i++) {
+        ino->direct[i] = 0;
+        if (remaining > 0) {
+            ino->direct[i] = (uint32_t)next_data++;
+            remaining--;
+        }
+    }
+    for (int depth = 1; depth <= 3 && remaining > 0; depth++) {
+        top[depth - 1] = plan_map_fill(meta, &meta_used, meta_base, depth, &next_data, &remaining);
+    }
+    ino->indirect = top[0];
+    ino->double_indirect = top[1];
+    ino->triple_indirect = top[2];
+    return meta_used;
+}
 
+int plan_add_node(pop_plan_t* plan, const char* host_path, const char* name, const struct stat* st, uint32_t parent) {
+    if (plan->count == UINT32_MAX - 1) {
+        fprintf(stderr, "Too many files to populate\n");
+        return -1;
+    }
+    if (plan->count == plan->capacity) {
+        uint32_t cap = plan->capacity ? plan->capacity * 2 : 1024;
+        pop_node_t* nodes = realloc(plan->nodes, (size_t)cap * sizeof(pop_node_t));
+        if (!nodes) {
+            perror("Memory allocation failed for populate plan");
+            return -1;
+        }
+        plan->nodes = nodes;
+        plan->capacity = cap;
+    }
 
-int create_filesystem(const char* image_path, uint64_t size_kib, uint64_t inode_count) {
-    uint64_t total_blocks = (size_kib * 1024) / BS;
-    time_t build_time = time(NULL);
-    
+    pop_node_t* n = &plan->nodes[plan->count];
+    memset(n, 0, sizeof(*n));
+    if (host_path) {
+        n->host_path = strdup(host_path);
+        if (!n->host_path) {
+            perror("Memory allocation failed for populate plan");
+            return -1;
+        }
+    }
+    strcpy(n->name, name);
+    n->is_dir = st ? S_ISDIR(st->st_mode) : 1;
+    n->size_bytes = (st && !n->is_dir) ? (uint64_t)st->st_size : 0;
+    n->mtime = st ? (uint64_t)st->st_mtime : 0;
+    n->parent = parent;
+    plan->count++;
+    return 0;
+}
 
-    uint64_t min_blocks = 4 + ((inode_count * INODE_SIZE + BS - 1) / BS);
+int compare_nodes_by_name(const void* a, const void* b) {
+    return strcmp(((const pop_node_t*)a)->name, ((const pop_node_t*)b)->name);
+}
 
-    
-     
-    if (total_blocks < min_blocks) {
-        perror("Image size too small");
+// Breadth-first walk so every directory's children end up contiguous
+int plan_scan(pop_plan_t* plan, const char* root_dir) {
+    struct stat st;
+    if (root_dir) {
+        if (stat(root_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Cannot populate from %s: not a directory\n", root_dir);
+            return -1;
+        }
+    }
+    if (plan_add_node(plan, root_dir, "", root_dir ? &st : NULL, 0) != 0) {
         return -1;
     }
-    
-    FILE* img_file = fopen(image_path, "wb");
-    if (img_file == NULL) {
-        perror("Failed to create image file");
+
+    for (uint32_t i = 0; i < plan->count; i++) {
+        if (!plan->nodes[i].is_dir || !plan->nodes[i].host_path) {
+            continue;
+        }
+
+        DIR* dir = opendir(plan->nodes[i].host_path);
+        if (!dir) {
+            perror("Cannot open directory to populate");
+            return -1;
+        }
+
+        uint32_t first = plan->count;
+        struct dirent* de;
+        while ((de = readdir(dir)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", plan->nodes[i].host_path, de->d_name) >= (int)sizeof(path)) {
+                fprintf(stderr, "Path too long: %s/%s\n", plan->nodes[i].host_path, de->d_name);
+                closedir(dir);
+                return -1;
+            }
+            if (lstat(path, &st) != 0) {
+                perror("Cannot access file to populate");
+                closedir(dir);
+                return -1;
+            }
+            if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "Skipping %s: not a regular file or directory\n", path);
+                continue;
+            }
+            if (strlen(de->d_name) >= 58) {
+                fprintf(stderr, "Filename too long to add (exceeds 57 characters): %s\n", path);
+                closedir(dir);
+                return -1;
+            }
+            if (S_ISREG(st.st_mode) && ((uint64_t)st.st_size + BS - 1) / BS > MAX_FILE_BLOCKS) {
+                fprintf(stderr, "File too large to add (exceeds block map limit): %s\n", path);
+                closedir(dir);
+                return -1;
+            }
+            if (plan_add_node(plan, path, de->d_name, &st, i) != 0) {
+                closedir(dir);
+                return -1;
+            }
+        }
+        closedir(dir);
+
+        // Sorted so the same tree always produces the same image
+        qsort(plan->nodes + first, plan->count - first, sizeof(pop_node_t), compare_nodes_by_name);
+        plan->nodes[i].first_child = first;
+        plan->nodes[i].child_count = plan->count - first;
+    }
+    return 0;
+}
+
+// Assign every node a contiguous run of data blocks (data, then pointer blocks)
+void plan_layout(pop_plan_t* plan) {
+    uint64_t cursor = 1; // data block 1 is the root directory
+    for (uint32_t i = 0; i < plan->count; i++) {
+        pop_node_t* n = &plan->nodes[i];
+        if (n->is_dir) {
+            n->data_blocks = dir_blocks_for(2 + (uint64_t)n->child_count); // . and ..
+            n->size_bytes = n->data_blocks * BS;
+        } else {
+            n->data_blocks = (n->size_bytes + BS - 1) / BS;
+        }
+
+        inode_t scratch;
+        n->first_block = cursor;
+        n->map_blocks = plan_block_map(&scratch, NULL, cursor, n->data_blocks);
+        cursor += n->data_blocks + n->map_blocks;
+    }
+    plan->used_blocks = cursor - 1;
+}
+
+void plan_free(pop_plan_t* plan) {
+    for (uint32_t i = 0; i < plan->count; i++) {
+        free(plan->nodes[i].host_path);
+    }
+    free(plan->nodes);
+}
+
+void build_node_inode(const pop_plan_t* plan, uint32_t i, inode_t* ino, time_t build_time) {
+    const pop_node_t* n = &plan->nodes[i];
+
+    if (i == 0) {
+        init_root_inode(ino, build_time, 2); //proj_id = 2
+    } else {
+        memset(ino, 0, sizeof(inode_t));
+        ino->mode = n->is_dir ? 0040000 : 0100000;
+        ino->atime = (uint64_t)build_time;
+        ino->mtime = n->mtime;
+        ino->ctime = (uint64_t)build_time;
+    }
+    // same convention as the adder: a directory gains a link per entry
+    ino->links = 1;
+    if (n->is_dir) {
+        ino->links = n->child_count < UINT16_MAX - 2 ? (uint16_t)(2 + n->child_count) : UINT16_MAX;
+    }
+    ino->size_bytes = n->size_bytes;
+    plan_block_map(ino, NULL, n->first_block, n->data_blocks);
+    inode_checksum(ino);
+}
+
+// Hash placement of a directory's children, matching the probing the adder
+// does: children of block b are order[start[b] .. start[b + 1]), as offsets
+// from the directory's first child
+typedef struct {
+    uint64_t* start;
+    uint32_t* order;
+} dir_placement_t;
+
+int plan_dir_placement(const pop_plan_t* plan, uint32_t i, dir_placement_t* place) {
+    const pop_node_t* n = &plan->nodes[i];
+    uint64_t dir_blocks = n->data_blocks;
+
+    uint16_t* fill = calloc(dir_blocks, sizeof(uint16_t));
+    uint32_t* home = malloc(((size_t)n->child_count + 1) * sizeof(uint32_t));
+    place->start = calloc(dir_blocks + 1, sizeof(uint64_t));
+    place->order = malloc(((size_t)n->child_count + 1) * sizeof(uint32_t));
+    if (!fill || !home || !place->start || !place->order) {
+        perror("Memory allocation failed for directory");
+        free(fill);
+        free(home);
         return -1;
     }
-    
-    
+
+    fill[0] = 2; // . and ..
+    for (uint32_t c = 0; c < n->child_count; c++) {
+        uint64_t b = dir_hash(plan->nodes[n->first_child + c].name) % dir_blocks;
+        while (fill[b] == DIRENTS_PER_BLOCK) {
+            b = (b + 1) % dir_blocks;
+        }
+        fill[b]++;
+        home[c] = (uint32_t)b;
+        place->start[b + 1]++;
+    }
+    for (uint64_t b = 0; b < dir_blocks; b++) {
+        place->start[b + 1] += place->start[b];
+    }
+    for (uint32_t c = 0; c < n->child_count; c++) {
+        place->order[place->start[home[c]] + (--fill[home[c]]) - (home[c] == 0 ? 2 : 0)] = c;
+    }
+
+    free(fill);
+    free(home);
+    return 0;
+}
+
+void plan_dir_placement_free(dir_placement_t* place) {
+    free(place->start);
+    free(place->order);
+}
+
+// Directory block k of node i: "." and ".." lead block 0, children follow
+// in the blocks their names hash to
+void build_dir_block(const pop_plan_t* plan, uint32_t i, uint64_t k, const dir_placement_t* place,
+                     dirent64_t* entries) {
+    const pop_node_t* n = &plan->nodes[i];
+    uint32_t s = 0;
+    memset(entries, 0, BS);
+
+    if (k == 0) {
+        dirent_init(&entries[s++], i + 1, 2, ".");
+        dirent_init(&entries[s++], n->parent + 1, 2, ".."); // the root is its own parent
+    }
+    for (uint64_t j = place->start[k]; j < place->start[k + 1]; j++) {
+        uint32_t c = n->first_child + place->order[j];
+        dirent_init(&entries[s++], c + 1, plan->nodes[c].is_dir ? 2 : 1, plan->nodes[c].name);
+    }
+}
+
+typedef struct {
+    uint32_t node;
+    uint64_t offset;
+    uint32_t length;
+} pop_task_t;
+
+// Ring of chunk buffers filled by worker threads and drained in order by the writer
+typedef struct {
+    const pop_plan_t* plan;
+    pop_task_t* tasks;
+    uint64_t task_count;
+    uint64_t next_task;     // next task a worker claims
+    uint32_t slot_count;
+    uint8_t* buffers;
+    uint64_t* slot_task;    // task each slot is reserved for
+    int* slot_ready;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pop_reader_t;
+
+int read_source_chunk(const char* path, uint64_t offset, uint8_t* buf, uint32_t length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Cannot open file to populate");
+        return -1;
+    }
+
+    uint32_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, buf + done, length - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Failed to read %s (file changed while populating?)\n", path);
+            close(fd);
+            return -1;
+        }
+        done += (uint32_t)n;
+    }
+    close(fd);
+    stats_add(STAT_BYTES_READ, length);
+
+    // pad the last block of the chunk with zeros
+    uint32_t padded = (length + BS - 1) / BS * BS;
+    memset(buf + length, 0, padded - length);
+    return 0;
+}
+
+void* pop_reader_worker(void* arg) {
+    pop_reader_t* r = (pop_reader_t*)arg;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->failed && r->next_task < r->task_count) {
+        uint64_t t = r->next_task++;
+        uint32_t s = (uint32_t)(t % r->slot_count);
+        while (!r->failed && r->slot_task[s] != t) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (r->failed) {
+            break;
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        const pop_task_t* task = &r->tasks[t];
+        uint8_t* buf = r->buffers + (uint64_t)s * POPULATE_CHUNK_BLOCKS * BS;
+        int rc = read_source_chunk(r->plan->nodes[task->node].host_path, task->offset, buf, task->length);
+
+        pthread_mutex_lock(&r->lock);
+        if (rc != 0) {
+            r->failed = 1;
+        } else {
+            r->slot_ready[s] = 1;
+        }
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+uint8_t* pop_reader_wait(pop_reader_t* r, uint64_t t) {
+    uint32_t s = (uint32_t)(t % r->slot_count);
+    pthread_mutex_lock(&r->lock);
+    while (!r->failed && !(r->slot_task[s] == t && r->slot_ready[s])) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    int failed = r->failed;
+    pthread_mutex_unlock(&r->lock);
+    return failed ? NULL : r->buffers + (uint64_t)s * POPULATE_CHUNK_BLOCKS * BS;
+}
+
+void pop_reader_release(pop_reader_t* r, uint64_t t) {
+    uint32_t s = (uint32_t)(t % r->slot_count);
+    pthread_mutex_lock(&r->lock);
+    r->slot_ready[s] = 0;
+    r->slot_task[s] = t + r->slot_count;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void pop_reader_abort(pop_reader_t* r) {
+    pthread_mutex_lock(&r->lock);
+    r->failed = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+int pop_reader_init(pop_reader_t* r, const pop_plan_t* plan, int jobs) {
+    memset(r, 0, sizeof(*r));
+    r->plan = plan;
+
+    for (uint32_t i = 0; i < plan->count; i++) {
+        if (!plan->nodes[i].is_dir) {
+            r->task_count += (plan->nodes[i].size_bytes + POPULATE_CHUNK_BLOCKS * BS - 1) / (POPULATE_CHUNK_BLOCKS * BS);
+        }
+    }
+
+    r->slot_count = 2 * (uint32_t)jobs; // double buffering per worker
+    r->tasks = malloc((r->task_count ? r->task_count : 1) * sizeof(pop_task_t));
+    r->buffers = malloc((uint64_t)r->slot_count * POPULATE_CHUNK_BLOCKS * BS);
+    r->slot_task = malloc(r->slot_count * sizeof(uint64_t));
+    r->slot_ready = calloc(r->slot_count, sizeof(int));
+    if (!r->tasks || !r->buffers || !r->slot_task || !r->slot_ready) {
+        perror("Memory allocation failed for populate readers");
+        return -1;
+    }
+
+    uint64_t t = 0;
+    for (uint32_t i = 0; i < plan->count; i++) {
+        const pop_node_t* n = &plan->nodes[i];
+        for (uint64_t off = 0; !n->is_dir && off < n->size_bytes; off += POPULATE_CHUNK_BLOCKS * BS) {
+            uint64_t len = n->size_bytes - off;
+            r->tasks[t].node = i;
+            r->tasks[t].offset = off;
+            r->tasks[t].length = (uint32_t)(len < POPULATE_CHUNK_BLOCKS * BS ? len : POPULATE_CHUNK_BLOCKS * BS);
+            t++;
+        }
+    }
+    for (uint32_t s = 0; s < r->slot_count; s++) {
+        r->slot_task[s] = s;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    return 0;
+}
+
+void pop_reader_destroy(pop_reader_t* r) {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->tasks);
+    free(r->buffers);
+    free(r->slot_task);
+    free(r->slot_ready);
+}
+
+int write_blocks(FILE* img_file, const void* data, uint64_t blocks) {
+    if (blocks > 0 && fwrite(data, BS, blocks, img_file) != blocks) {
+        perror("Failed to write image");
+        return -1;
+    }
+    stats_add(STAT_BYTES_WRITTEN, blocks * BS);
+    return 0;
+}
+
+// Stream the data region for the plan: every node's data blocks followed by
+// its pointer blocks, in block order
+int write_data_region(FILE* img_file, const pop_plan_t* plan, int jobs) {
+    pop_reader_t reader;
+    if (pop_reader_init(&reader, plan, jobs) != 0) {
+        pop_reader_destroy(&reader);
+        return -1;
+    }
+
+    pthread_t* workers = calloc((size_t)jobs, sizeof(pthread_t));
+    int started = 0;
+    int rc = workers ? 0 : -1;
+    for (; rc == 0 && started < jobs && (uint64_t)started < reader.task_count; started++) {
+        if (pthread_create(&workers[started], NULL, pop_reader_worker, &reader) != 0) {
+            perror("Failed to start populate worker");
+            rc = -1;
+            break;
+        }
+    }
+
+    uint8_t* block_buffer = malloc(BS);
+    if (!block_buffer) {
+        rc = -1;
+    }
+
+    uint64_t t = 0;
+    for (uint32_t i = 0; rc == 0 && i < plan->count; i++) {
+        const pop_node_t* n = &plan->nodes[i];
+
+        if (n->is_dir) {
+            dir_placement_t place;
+            rc = plan_dir_placement(plan, i, &place);
+            for (uint64_t k = 0; rc == 0 && k < n->data_blocks; k++) {
+                build_dir_block(plan, i, k, &place, (dirent64_t*)block_buffer);
+                rc = write_blocks(img_file, block_buffer, 1);
+            }
+            plan_dir_placement_free(&place);
+        } else {
+            for (uint64_t off = 0; rc == 0 && off < n->size_bytes; off += POPULATE_CHUNK_BLOCKS * BS, t++) {
+                uint8_t* chunk = pop_reader_wait(&reader, t);
+                if (!chunk) {
+                    rc = -1;
+                    break;
+                }
+                rc = write_blocks(img_file, chunk, (reader.tasks[t].length + BS - 1) / BS);
+                pop_reader_release(&reader, t);
+            }
+        }
+
+        if (rc == 0 && n->map_blocks > 0) {
+            uint32_t* meta = calloc(n->map_blocks, BS);
+            inode_t scratch;
+            if (!meta) {
+                perror("Memory allocation failed for block map");
+                rc = -1;
+                break;
+            }
+            plan_block_map(&scratch, meta, n->first_block, n->data_blocks);
+            rc = write_blocks(img_file, meta, n->map_blocks);
+            free(meta);
+        }
+    }
+
+    if (rc != 0) {
+        pop_reader_abort(&reader);
+    }
+    for (int w = 0; w < started; w++) {
+        pthread_join(workers[w], NULL);
+    }
+    free(workers);
+    free(block_buffer);
+    pop_reader_destroy(&reader);
+    return rc;
+}
+
+// Size the image to its full length without writing the (all-zero) data region.
+// Plain mode leaves a sparse file; --preallocate reserves the blocks up front.
+int size_image_file(FILE* img_file, uint64_t total_bytes, int preallocate) {
+    if (fflush(img_file) != 0) {
+        perror("Failed to flush image metadata");
+        return -1;
+    }
+
+    int fd = fileno(img_file);
+    if (preallocate) {
+        if (fallocate(fd, 0, 0, (off_t)total_bytes) != 0) {
+            perror("Failed to preallocate image file");
+            return -1;
+        }
+    } else if (ftruncate(fd, (off_t)total_bytes) != 0) {
+        perror("Failed to set image file size");
+        return -1;
+    }
+    return 0;
+}
+
+// Write the bitmap region starting at start_block with its first used_bits bits
+// set. Blocks past the used prefix are all zero and are left as holes.
+int write_bitmap(FILE* img_file, uint8_t* block_buffer, uint64_t start_block, uint64_t used_bits) {
+    uint64_t blocks = (used_bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+
+    if (blocks > 0 && fseeko(img_file, (off_t)(start_block * BS), SEEK_SET) != 0) {
+        perror("Failed to seek to bitmap");
+        return -1;
+    }
+    for (uint64_t b = 0; b < blocks; b++) {
+        uint64_t first = b * BITS_PER_BLOCK;
+        uint64_t bits = used_bits - first < BITS_PER_BLOCK ? used_bits - first : BITS_PER_BLOCK;
+
+        memset(block_buffer, 0, BS);
+        memset(block_buffer, 0xFF, bits / 8);
+        for (uint64_t i = bits / 8 * 8; i < bits; i++) {
+            bitmap_set(block_buffer, i);
+        }
+        if (write_blocks(img_file, block_buffer, 1) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int write_filesystem(FILE* img_file, const pop_plan_t* plan, uint64_t total_blocks, uint64_t inode_count,
+                     time_t build_time, int jobs) {
+    uint64_t t0 = stats_now();
     superblock_t superblock;
-    init_superblock(&superblock, total_blocks, inode_count, build_time);
-    
-   
+    if (init_superblock(&superblock, total_blocks, inode_count, build_time) != 0) {
+        fprintf(stderr, "Invalid image geometry\n");
+        return -1;
+    }
+
+    // Inode table blocks holding planned inodes are written (rounded up to whole
+    // groups); the remaining groups are marked uninitialised and zeroed by the
+    // adder when it first allocates in them.
+    uint64_t group_blocks = itable_group_blocks(superblock.inode_table_blocks);
+    uint64_t used_itable = ((uint64_t)plan->count * INODE_SIZE + BS - 1) / BS;
+    uint64_t inode_blocks = (used_itable + group_blocks - 1) / group_blocks * group_blocks;
+    if (inode_blocks > superblock.inode_table_blocks) {
+        inode_blocks = superblock.inode_table_blocks;
+    }
+
     uint8_t* block_buffer = calloc(1, BS);
+    if (!block_buffer) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    int rc = 0;
 
-    
-    
+    init_itable_uninit_markers(block_buffer, &superblock, inode_blocks / group_blocks);
+    sb_ext_t* ext = (sb_ext_t*)(block_buffer + SB_EXT_OFFSET);
+    ext->inode_alloc_hint = plan->count;
+    ext->data_alloc_hint = plan->used_blocks;
+    ext->root_entries = plan->nodes[0].child_count;
     memcpy(block_buffer, &superblock, sizeof(superblock_t));
-    superblock_crc_finalize((superblock_t*)block_buffer);
-
-    fwrite(block_buffer, BS, 1, img_file);
-       
-       
-  
-    
-    // Write inode bitmap (block 1)
-    memset(block_buffer, 0, BS);
-    // bit 0 = inode 1
-    block_buffer[0] = 0x01;
+    superblock_checksum((superblock_t*)block_buffer);
+    rc = write_blocks(img_file, block_buffer, 1);
 
-    fwrite(block_buffer, BS, 1, img_file);
-    
-    // Write data bitmap (block 2)
-    memset(block_buffer, 0, BS);
-    // for root directory
-    block_buffer[0] = 0x01;
+    // Inode bitmap: inodes 1..count are in use
+    if (rc == 0) {
+        rc = write_bitmap(img_file, block_buffer, superblock.inode_bitmap_start, plan->count);
+    }
+    // Data bitmap: data blocks 1..used_blocks are in use
+    if (rc == 0) {
+        rc = write_bitmap(img_file, block_buffer, superblock.data_bitmap_start, plan->used_blocks);
+    }
 
-    fwrite(block_buffer, BS, 1, img_file);
-    
     // Write inode table
-    uint64_t inode_blocks = superblock.inode_table_blocks;
-
-    for (uint64_t i = 0; i < inode_blocks; i++) {
+    if (rc == 0 && fseeko(img_file, (off_t)(superblock.inode_table_start * BS), SEEK_SET) != 0) {
+        perror("Failed to seek to inode table");
+        rc = -1;
+    }
+    for (uint64_t b = 0; rc == 0 && b < inode_blocks; b++) {
         memset(block_buffer, 0, BS);
-        
-        // inode block-->root inode
-        if (i == 0) {
-            inode_t root_inode;
-            init_root_inode(&root_inode, build_time, 2); //proj_id = 2 
-            inode_crc_finalize(&root_inode);
-            memcpy(block_buffer, &root_inode, sizeof(inode_t));
+        for (uint32_t s = 0; s < BS / INODE_SIZE; s++) {
+            uint64_t i = b * (BS / INODE_SIZE) + s;
+            if (i >= plan->count) {
+                break;
+            }
+            build_node_inode(plan, (uint32_t)i, (inode_t*)(block_buffer + s * INODE_SIZE), build_time);
         }
-        
-        fwrite(block_buffer, BS, 1, img_file); 
+        rc = write_blocks(img_file, block_buffer, 1);
+    }
+    free(block_buffer);
+    stats_phase_end(PHASE_METADATA, t0);
 
+    if (rc == 0 && fseeko(img_file, (off_t)(superblock.data_region_start * BS), SEEK_SET) != 0) {
+        perror("Failed to seek to data region");
+        rc = -1;
     }
-    
-    // Write data region
-    uint64_t data_blocks = superblock.data_region_blocks;
-    for (uint64_t i = 0; i < data_blocks; i++) {
-        memset(block_buffer, 0, BS);
-        
-        // first data block-->root directory
-        if (i == 0) {
-            init_root_directory_entries((dirent64_t *)block_buffer);
+
+    // The root directory and any populated files; the rest of the data region
+    // is all zeros, so it is left to size_image_file() instead of being written
+    // out block by block.
+    if (rc == 0) {
+        t0 = stats_now();
+        rc = write_data_region(img_file, plan, jobs);
+        stats_phase_end(PHASE_DATA, t0);
+    }
+    return rc;
+}
+
+int create_filesystem(const char* image_path, uint64_t size_kib, uint64_t inode_count, int preallocate,
+                      const char* populate_dir, int jobs) {
+    time_t build_time = time(NULL);
+
+    uint64_t t0 = stats_now();
+    pop_plan_t plan;
+    memset(&plan, 0, sizeof(plan));
+    if (plan_scan(&plan, populate_dir) != 0) {
+        plan_free(&plan);
+        return -1;
+    }
+    plan_layout(&plan);
+    stats_phase_end(PHASE_SCAN, t0);
+
+    if (inode_count == 0) {
+        inode_count = plan.count; // exact count for the populated tree
+    }
+    if (inode_count < plan.count) {
+        fprintf(stderr, "Not enough inodes: the tree needs %u\n", plan.count);
+        plan_free(&plan);
+        return -1;
+    }
+    if (inode_count > MAX_INODES) {
+        fprintf(stderr, "Too many inodes: at most %" PRIu64 "\n", MAX_INODES);
+        plan_free(&plan);
+        return -1;
+    }
+
+    // Smallest image whose data region holds the plan; the metadata grows with
+    // the image, so step up until the layout settles
+    superblock_t layout;
+    uint64_t min_blocks = 3 + ((inode_count * INODE_SIZE + BS - 1) / BS) + plan.used_blocks;
+    while (compute_layout(&layout, min_blocks, inode_count) != 0 || layout.data_region_blocks < plan.used_blocks) {
+        if (min_blocks > MAX_DATA_BLOCKS * 2) {
+            fprintf(stderr, "Tree too large for a MiniVSFS image\n");
+            plan_free(&plan);
+            return -1;
         }
+        min_blocks += (compute_layout(&layout, min_blocks, inode_count) == 0)
+                      ? plan.used_blocks - layout.data_region_blocks : 1;
+    }
 
-        fwrite(block_buffer, BS, 1, img_file);
+    uint64_t total_blocks = size_kib ? (size_kib * 1024) / BS : min_blocks;
+    if (total_blocks < min_blocks) {
+        fprintf(stderr, "Image size too small: need at least %" PRIu64 " KiB\n", min_blocks * BS / 1024);
+        plan_free(&plan);
+        return -1;
+    }
+    if (compute_layout(&layout, total_blocks, inode_count) != 0) {
+        fprintf(stderr, "Image too large: the data region is limited to %" PRIu64 " blocks\n", MAX_DATA_BLOCKS);
+        plan_free(&plan);
+        return -1;
     }
     
-    free(block_buffer);
-    fclose(img_file);
+    FILE* img_file = fopen(image_path, "wb");
+    if (img_file == NULL) {
+        perror("Failed to create image file");
+        plan_free(&plan);
+        return -1;
+    }
+
+    if (write_filesystem(img_file, &plan, total_blocks, inode_count, build_time, jobs) != 0) {
+        fclose(img_file);
+        plan_free(&plan);
+        return -1;
+    }
+    t0 = stats_now();
+    int sized = size_image_file(img_file, total_blocks * BS, preallocate);
+    stats_phase_end(PHASE_SIZE, t0);
+    if (sized != 0) {
+        fclose(img_file);
+        plan_free(&plan);
+        return -1;
+    }
+
+    t0 = stats_now();
+    int closed = fclose(img_file);
+    stats_phase_end(PHASE_CLOSE, t0);
+    if (closed != 0) {
+        perror("Failed to close image file");
+        plan_free(&plan);
+        return -1;
+    }
 
     printf("Successfully created MiniVSFS image: %s\n", image_path); //sanity check
-    
+    if (populate_dir) {
+        printf("Populated %u inodes and %" PRIu64 " data blocks from %s\n", plan.count, plan.used_blocks, populate_dir);
+    }
+    plan_free(&plan);
     
     return 0;
 }
@@ -319,14 +1033,34 @@ int main(int argc, char* argv[]) {
     crc32_init();
     // WRITE YOUR DRIVER CODE HERE
     char* image_path;
+    char* populate_dir;
     uint64_t size_kib, inode_count;
+    int preallocate, jobs, stats;
+    gen_spec_t gen;
     // PARSE YOUR CLI PARAMETERS
-    if (parse_args(argc, argv, &image_path, &size_kib, &inode_count) != 0) {
-        fprintf(stderr, "Usage: %s --image <output.img> --size-kib <180..4096> --inodes <128..512>\n", argv[0]);;
+    if (parse_args(argc, argv, &image_path, &size_kib, &inode_count, &preallocate, &populate_dir, &jobs, &stats, &gen) != 0) {
+        fprintf(stderr, "Usage: %s --image <output.img> --size-kib <n> --inodes <n> [--preallocate] [--stats=json]\n"
+                        "       %s --image <output.img> --populate <dir> [--size-kib <n>] [--inodes <n>] [--jobs <n>] [--stats=json]\n"
+                        "       %s --generate <dir> [--workload tiny|lognormal|bimodal] [--files <n>] [--total-kib <n>] [--seed <n>]\n",
+                argv[0], argv[0], argv[0]);
         return 1;
     }
+    if (gen.dir) {
+        return generate_workload(&gen) == 0 ? 0 : 1;
+    }
+    FILE* stats_out = NULL;
+    if (stats) {
+        stats_enable(BUILD_PHASE_NAMES, BUILD_PHASES);
+        stats_out = stats_claim_stdout();
+    }
     // THEN CREATE YOUR FILE SYSTEM WITH A ROOT DIRECTORY
-    create_filesystem(image_path,size_kib,inode_count);
+    int rc = create_filesystem(image_path, size_kib, inode_count, preallocate, populate_dir, jobs);
+    if (stats_out) {
+        stats_print_json(stats_out, "mkfs_builder");
+    }
+    if (rc != 0) {
+        return 1;
+    }
     // THEN SAVE THE DATA INSIDE THE OUTPUT IMAGE
     return 0;
-}
\ No newline at end of file
+}
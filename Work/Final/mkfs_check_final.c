@@ -0,0 +1,499 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_check_final.c -o mkfs_check
+#include "minivsfs.h"
+#include <stdarg.h>
+
+#define CHECK_JOBS 4               // default worker threads
+#define CHECK_INODES_PER_TASK 65536u
+#define CHECK_BITS_PER_TASK (1u << 20)
+#define CHECK_MAX_REPORTS 50       // problems printed; all of them are counted
+
+// The checker walks the image on a work-stealing pool: one task per range of
+// inodes, one per block range of every large file or directory, and one per
+// range of the data bitmap at the end. Tasks record what they find in shared
+// tables that are only updated atomically. On a dedup image a data block may
+// be referenced as many times as its refcount says.
+typedef struct {
+    fs_image_t* fs;
+    uint8_t* seen;            // data blocks referenced by some inode (atomic)
+    uint16_t* shares;         // SB_FLAG_DEDUP: data references to each block (atomic)
+    uint32_t* refs;           // directory entries naming each inode (atomic)
+    uint32_t* children;       // entries in each directory, . and .. excluded (atomic)
+    uint8_t* scratch;         // inode_data_crc scratch, INODE_READ_SCRATCH_BYTES per worker
+    uint64_t problems;        // atomic
+    pthread_mutex_t report_lock;
+} check_t;
+
+check_t g_check;
+
+void check_report(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void check_report(const char* fmt, ...) {
+    uint64_t n = __atomic_fetch_add(&g_check.problems, 1, __ATOMIC_RELAXED);
+    if (n >= CHECK_MAX_REPORTS) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&g_check.report_lock);
+    vprintf(fmt, ap);
+    putchar('\n');
+    pthread_mutex_unlock(&g_check.report_lock);
+    va_end(ap);
+}
+
+int parse_args(int argc, char* argv[], char** image_path, int* jobs) {
+    *image_path = NULL;
+    *jobs = CHECK_JOBS;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return -1;
+        }
+        if (strcmp(argv[i], "--image") == 0) {
+            *image_path = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            *jobs = atoi(argv[++i]);
+        } else {
+            return -1;
+        }
+    }
+    return *image_path && *jobs >= 1 ? 0 : -1;
+}
+
+// Record a reference to a data block: it must be in range, marked used in the
+// data bitmap, and referenced only once (data blocks of a dedup image: only
+// by file data, counted against the refcount table later)
+void check_claim_block(uint32_t inode_no, uint32_t blk, const char* what) {
+    const fs_image_t* fs = g_check.fs;
+    if (blk == 0 || blk > fs->sb->data_region_blocks) {
+        check_report("inode %u: %s block %u is outside the data region", inode_no, what, blk);
+        return;
+    }
+    uint64_t bit = blk - 1;
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    int shared = 0;
+    if (g_check.shares && strcmp(what, "data") == 0) {
+        uint16_t refs = __atomic_fetch_add(&g_check.shares[bit], 1, __ATOMIC_RELAXED);
+        if (refs == UINT16_MAX) {
+            __atomic_store_n(&g_check.shares[bit], UINT16_MAX, __ATOMIC_RELAXED); // saturate
+        }
+        shared = refs > 0;
+    }
+    if (!shared && (__atomic_fetch_or((uint64_t*)g_check.seen + bit / 64, mask, __ATOMIC_RELAXED) & mask)) {
+        check_report("inode %u: %s block %u is referenced more than once", inode_no, what, blk);
+    }
+    if (!bitmap_test(fs->data_bitmap, bit)) {
+        check_report("inode %u: %s block %u is free in the data bitmap", inode_no, what, blk);
+    }
+}
+
+// Claim the pointer blocks of a map tree covering *remaining data blocks.
+// The data blocks themselves are claimed by check_data_range.
+void check_map_tree(uint32_t inode_no, uint32_t blk, int depth, uint64_t* remaining) {
+    uint64_t span = 1;
+    for (int d = 1; d < depth; d++) {
+        span *= PTRS_PER_BLOCK;
+    }
+    if (blk == 0) {
+        *remaining -= *remaining < span * PTRS_PER_BLOCK ? *remaining : span * PTRS_PER_BLOCK; // hole
+        return;
+    }
+    check_claim_block(inode_no, blk, "pointer");
+    if (blk > g_check.fs->sb->data_region_blocks) {
+        *remaining -= *remaining < span * PTRS_PER_BLOCK ? *remaining : span * PTRS_PER_BLOCK;
+        return;
+    }
+
+    const uint32_t* ptrs = (const uint32_t*)fs_block(g_check.fs, blk);
+    for (uint64_t k = 0; k < PTRS_PER_BLOCK && *remaining > 0; k++) {
+        if (depth > 1) {
+            check_map_tree(inode_no, ptrs[k], depth - 1, remaining);
+        } else {
+            (*remaining)--;
+        }
+    }
+}
+
+void check_data_range(ws_pool_t* pool, void* arg, uint64_t first, uint64_t count) {
+    (void)pool;
+    uint32_t inode_no = (uint32_t)(uintptr_t)arg;
+    const inode_t* ino = fs_inode(g_check.fs, inode_no);
+    for (uint64_t b = first; b < first + count; b++) {
+        uint32_t blk = inode_block_at(g_check.fs, ino, b);
+        if (blk != 0) {
+            check_claim_block(inode_no, blk, "data");
+        }
+    }
+}
+
+// Entries of directory blocks [first, first + count)
+void check_dir_range(ws_pool_t* pool, void* arg, uint64_t first, uint64_t count) {
+    (void)pool;
+    const fs_image_t* fs = g_check.fs;
+    uint32_t dir_no = (uint32_t)(uintptr_t)arg;
+    const inode_t* dir = fs_inode(fs, dir_no);
+    uint32_t children = 0;
+
+    for (uint64_t b = first; b < first + count; b++) {
+        dirent64_t* entries = dir_block_entries(fs, dir, b);
+        if (!entries) {
+            continue;
+        }
+        if (b == 0 && (entries[0].inode_no != dir_no || strcmp(entries[0].name, ".") != 0 ||
+                       strcmp(entries[1].name, "..") != 0)) {
+            check_report("directory %u: first block does not start with . and ..", dir_no);
+        }
+        for (uint32_t i = (b == 0 ? 2 : 0); i < DIRENTS_PER_BLOCK; i++) {
+            dirent64_t* de = &entries[i];
+            if (de->inode_no == 0) {
+                continue; // never used, or a tombstone
+            }
+            dirent64_t copy = *de;
+            dirent_checksum_finalize(&copy);
+            if (copy.checksum != de->checksum) {
+                check_report("directory %u: entry %s has a bad checksum", dir_no, de->name);
+            }
+            if (memchr(de->name, '\0', sizeof(de->name)) == NULL || de->name[0] == '\0') {
+                check_report("directory %u: entry %" PRIu64 ".%u has a bad name", dir_no, b, i);
+                continue;
+            }
+            if (de->inode_no > fs->sb->inode_count || !bitmap_test(fs->inode_bitmap, de->inode_no - 1)) {
+                check_report("directory %u: entry %s names free inode %u", dir_no, de->name, de->inode_no);
+                continue;
+            }
+            const inode_t* target = fs_inode(fs, de->inode_no);
+            uint8_t type = (target->mode & 0170000) == 0040000 ? 2 : 1;
+            if (de->type != type) {
+                check_report("directory %u: entry %s has type %u but inode %u is a %s", dir_no, de->name,
+                             de->type, de->inode_no, type == 2 ? "directory" : "file");
+            }
+            if (dir_lookup(fs, dir, de->name) != de) {
+                check_report("directory %u: entry %s is not where a lookup finds it (misplaced or duplicate)",
+                             dir_no, de->name);
+            }
+            __atomic_add_fetch(&g_check.refs[de->inode_no], 1, __ATOMIC_RELAXED);
+            children++;
+        }
+    }
+    __atomic_add_fetch(&g_check.children[dir_no], children, __ATOMIC_RELAXED);
+}
+
+// Queue block-range tasks over blocks [0, blocks) of an inode
+void check_push_ranges(ws_pool_t* pool, ws_fn fn, uint32_t inode_no, uint64_t blocks) {
+    for (uint64_t start = 0; start < blocks; start += WS_RANGE_BLOCKS) {
+        uint64_t n = blocks - start < WS_RANGE_BLOCKS ? blocks - start : WS_RANGE_BLOCKS;
+        if (ws_push(pool, fn, (void*)(uintptr_t)inode_no, start, n) != 0) {
+            fn(pool, (void*)(uintptr_t)inode_no, start, n);
+        }
+    }
+}
+
+int check_itable_group_uninit(const fs_image_t* fs, uint32_t inode_no) {
+    if (!(fs->sb->flags & SB_FLAG_LAZY_ITABLE)) {
+        return 0;
+    }
+    uint64_t group_blocks = itable_group_blocks(fs->sb->inode_table_blocks);
+    uint64_t g = ((uint64_t)(inode_no - 1) * INODE_SIZE / BS) / group_blocks;
+    return bitmap_test(fs->img_data + ITABLE_UNINIT_OFFSET, g);
+}
+
+// The chunk table of a compressed file: offsets in order, each chunk no longer
+// than its data, the first right after the table. Returns the stream size, or
+// 0 if the table is bad.
+uint64_t check_compressed(uint32_t inode_no, const inode_t* ino) {
+    const fs_image_t* fs = g_check.fs;
+    uint64_t chunks = compress_chunk_count(ino->size_bytes);
+    uint64_t table = compress_table_bytes(ino->size_bytes);
+    if ((table + ino->size_bytes + BS - 1) / BS > MAX_FILE_BLOCKS) {
+        check_report("inode %u: compressed size %" PRIu64 " is beyond the block map limit", inode_no, ino->size_bytes);
+        return 0;
+    }
+    uint64_t prev;
+    inode_stream_read(fs, ino, 0, (uint8_t*)&prev, sizeof(prev));
+    if (prev != table) {
+        check_report("inode %u: compressed data does not start after its chunk table", inode_no);
+        return 0;
+    }
+    for (uint64_t c = 0; c < chunks; c++) {
+        uint64_t next;
+        inode_stream_read(fs, ino, (c + 1) * sizeof(uint64_t), (uint8_t*)&next, sizeof(next));
+        uint64_t want = ino->size_bytes - c * COMPRESS_CHUNK_BYTES < COMPRESS_CHUNK_BYTES
+                            ? ino->size_bytes - c * COMPRESS_CHUNK_BYTES : COMPRESS_CHUNK_BYTES;
+        if (next < prev || next - prev > want) {
+            check_report("inode %u: compressed chunk %" PRIu64 " has a bad extent", inode_no, c);
+            return 0;
+        }
+        prev = next;
+    }
+    return prev;
+}
+
+// Allocated inodes in [first, first + count)
+void check_inode_range(ws_pool_t* pool, void* arg, uint64_t first, uint64_t count) {
+    (void)arg;
+    const fs_image_t* fs = g_check.fs;
+    for (uint64_t bit = first; bit < first + count; bit++) {
+        if (!bitmap_test(fs->inode_bitmap, bit)) {
+            continue;
+        }
+        uint32_t inode_no = (uint32_t)(bit + 1);
+        if (check_itable_group_uninit(fs, inode_no)) {
+            check_report("inode %u: allocated in an uninitialised inode table group", inode_no);
+            continue;
+        }
+        const inode_t* ino = fs_inode(fs, inode_no);
+        inode_t copy = *ino;
+        inode_checksum(&copy);
+        if (copy.inode_crc != ino->inode_crc) {
+            check_report("inode %u: bad checksum", inode_no);
+        }
+
+        int is_dir = (ino->mode & 0170000) == 0040000;
+        if (!is_dir && (ino->mode & 0170000) != 0100000) {
+            check_report("inode %u: mode %o is neither a file nor a directory", inode_no, ino->mode);
+            continue;
+        }
+        uint64_t blocks = (ino->size_bytes + BS - 1) / BS;
+        if (ino->flags & INODE_FLAG_COMPRESSED) {
+            uint64_t stored = is_dir ? 0 : check_compressed(inode_no, ino);
+            if (stored == 0) {
+                if (is_dir) {
+                    check_report("inode %u: directory is marked compressed", inode_no);
+                }
+                continue;
+            }
+            blocks = (stored + BS - 1) / BS; // the block map covers the stream
+        } else if (blocks > MAX_FILE_BLOCKS) {
+            check_report("inode %u: size %" PRIu64 " is beyond the block map limit", inode_no, ino->size_bytes);
+            continue;
+        }
+
+        // Pointer blocks here, data blocks in stealable ranges
+        uint64_t remaining = blocks > DIRECT_MAX ? blocks - DIRECT_MAX : 0;
+        uint32_t tops[3] = { ino->indirect, ino->double_indirect, ino->triple_indirect };
+        for (int depth = 1; depth <= 3 && remaining > 0; depth++) {
+            check_map_tree(inode_no, tops[depth - 1], depth, &remaining);
+        }
+        if ((ino->flags & INODE_FLAG_DATA_CRC) && !is_dir) {
+            uint8_t* scratch = g_check.scratch + (size_t)g_ws_worker * INODE_READ_SCRATCH_BYTES;
+            uint32_t crc;
+            if (inode_data_crc(fs, ino, &crc, scratch) != 0 || crc != ino->data_crc) {
+                check_report("inode %u: data does not match its stored crc32", inode_no);
+            }
+        }
+        check_push_ranges(pool, check_data_range, inode_no, blocks);
+        if (is_dir) {
+            check_push_ranges(pool, check_dir_range, inode_no, ino->size_bytes / BS);
+        }
+    }
+}
+
+// Entries of dedup index blocks [first, first + count): each names a stored
+// block with that content
+void check_dedup_index_range(ws_pool_t* pool, void* arg, uint64_t first, uint64_t count) {
+    (void)pool;
+    (void)arg;
+    fs_image_t* fs = g_check.fs;
+    for (uint64_t b = first; b < first + count; b++) {
+        const dedup_entry_t* entries = (const dedup_entry_t*)dedup_table_block(fs, fs->ext->dedup_index_ino, b, 0);
+        for (uint32_t i = 0; entries && i < DEDUP_ENTRIES_PER_BLOCK; i++) {
+            uint32_t blk = entries[i].block;
+            if (blk == 0) {
+                continue; // never used, or a tombstone
+            }
+            if (blk > fs->sb->data_region_blocks || dedup_refcount(fs, blk) == 0) {
+                check_report("dedup index: entry %" PRIu64 ".%u names block %u, which holds no shared data", b, i,
+                             blk);
+                continue;
+            }
+            uint64_t hash[2];
+            dedup_hash(fs_block(fs, blk), hash);
+            if (hash[0] != entries[i].hash[0] || hash[1] != entries[i].hash[1]) {
+                check_report("dedup index: entry %" PRIu64 ".%u does not match the content of block %u", b, i, blk);
+            }
+        }
+    }
+}
+
+// Data bitmap bits [first, first + count) against the blocks referenced
+void check_bitmap_range(ws_pool_t* pool, void* arg, uint64_t first, uint64_t count) {
+    (void)pool;
+    (void)arg;
+    fs_image_t* fs = g_check.fs;
+    for (uint64_t bit = first; bit < first + count; bit++) {
+        if (bitmap_test(fs->data_bitmap, bit) && !bitmap_test(g_check.seen, bit)) {
+            check_report("data block %" PRIu64 " is marked used but nothing references it", bit + 1);
+        }
+        if (!g_check.shares) {
+            continue;
+        }
+        uint16_t refcount = dedup_refcount(fs, (uint32_t)(bit + 1));
+        uint16_t refs = g_check.shares[bit];
+        if (refcount == 0 ? refs > 1 : refs != refcount) {
+            check_report("data block %" PRIu64 " has refcount %u but %u references", bit + 1, refcount, refs);
+        }
+    }
+}
+
+// Superblock checksum and layout. Returns -1 if either is bad: everything
+// else is found through those fields, so nothing past them is checked.
+int check_superblock(const fs_image_t* fs) {
+    int rc = 0;
+    if (!superblock_checksum_ok(fs->sb)) {
+        check_report("superblock: bad checksum");
+        rc = -1;
+    }
+    if (!layout_is_valid(fs->sb)) {
+        check_report("superblock: layout does not match its block and inode counts");
+        rc = -1;
+    }
+    return rc;
+}
+
+// The dedup tables and the hints in the superblock extension
+void check_superblock_ext(const fs_image_t* fs) {
+    if (fs->sb->flags & SB_FLAG_DEDUP) {
+        uint32_t tables[2] = { fs->ext->dedup_refcount_ino, fs->ext->dedup_index_ino };
+        for (int t = 0; t < 2; t++) {
+            if (tables[t] == 0 || tables[t] > fs->sb->inode_count || !bitmap_test(fs->inode_bitmap, tables[t] - 1)) {
+                check_report("superblock: dedup table inode %u is not allocated", tables[t]);
+            }
+        }
+    }
+
+    for (uint64_t bit = 0; bit < fs->ext->inode_alloc_hint && bit < fs->sb->inode_count; bit++) {
+        if (!bitmap_test(fs->inode_bitmap, bit)) {
+            check_report("superblock: inode %" PRIu64 " is free but below the allocation hint", bit + 1);
+            break;
+        }
+    }
+    for (uint64_t bit = 0; bit < fs->ext->data_alloc_hint && bit < fs->sb->data_region_blocks; bit++) {
+        if (!bitmap_test(fs->data_bitmap, bit)) {
+            check_report("superblock: data block %" PRIu64 " is free but below the allocation hint", bit + 1);
+            break;
+        }
+    }
+}
+
+// Link counts and directory membership, once every directory has been read
+void check_links(const fs_image_t* fs) {
+    const inode_t* root = fs_inode(fs, ROOT_INO);
+    if (!bitmap_test(fs->inode_bitmap, ROOT_INO - 1) || (root->mode & 0170000) != 0040000) {
+        check_report("root inode is not an allocated directory");
+    }
+    if (fs->ext->root_entries != g_check.children[ROOT_INO]) {
+        check_report("superblock: root entry count %" PRIu64 " but the root directory holds %u",
+                     fs->ext->root_entries, g_check.children[ROOT_INO]);
+    }
+
+    for (uint64_t bit = 0; bit < fs->sb->inode_count; bit++) {
+        if (!bitmap_test(fs->inode_bitmap, bit) || check_itable_group_uninit(fs, (uint32_t)(bit + 1))) {
+            continue;
+        }
+        uint32_t inode_no = (uint32_t)(bit + 1);
+        const inode_t* ino = fs_inode(fs, inode_no);
+        int internal = (fs->sb->flags & SB_FLAG_DEDUP) &&
+                       (inode_no == fs->ext->dedup_refcount_ino || inode_no == fs->ext->dedup_index_ino);
+        if (inode_no != ROOT_INO && !internal && g_check.refs[inode_no] == 0) {
+            check_report("inode %u: allocated but not in any directory", inode_no);
+        }
+        uint64_t links = (ino->mode & 0170000) == 0040000 ? 2 + (uint64_t)g_check.children[inode_no]
+                       : internal                         ? 1
+                                                          : g_check.refs[inode_no];
+        if (links > UINT16_MAX) {
+            links = UINT16_MAX; // link counts saturate
+        }
+        if (ino->links != links) {
+            check_report("inode %u: link count %u, expected %" PRIu64, inode_no, ino->links, links);
+        }
+    }
+}
+
+int check_filesystem(const char* image_path, int jobs) {
+    fs_image_t fs;
+    if (fs_map(&fs, image_path, NULL, 0) != 0) {
+        return -1;
+    }
+
+    memset(&g_check, 0, sizeof(g_check));
+    g_check.fs = &fs;
+    pthread_mutex_init(&g_check.report_lock, NULL);
+    if (check_superblock(&fs) != 0) {
+        printf("%s: %" PRIu64 " problem%s found (superblock damaged, nothing else checked)\n", image_path,
+               g_check.problems, g_check.problems == 1 ? "" : "s");
+        pthread_mutex_destroy(&g_check.report_lock);
+        fs_close(&fs);
+        return 1;
+    }
+    g_check.seen = calloc(fs.sb->data_region_blocks / 64 + 1, sizeof(uint64_t));
+    g_check.refs = calloc(fs.sb->inode_count + 1, sizeof(uint32_t));
+    g_check.children = calloc(fs.sb->inode_count + 1, sizeof(uint32_t));
+    int dedup = (fs.sb->flags & SB_FLAG_DEDUP) != 0;
+    g_check.shares = dedup ? calloc(fs.sb->data_region_blocks, sizeof(uint16_t)) : NULL;
+    g_check.scratch = malloc((size_t)jobs * INODE_READ_SCRATCH_BYTES);
+    ws_pool_t pool;
+    if (!g_check.seen || !g_check.refs || !g_check.children || (dedup && !g_check.shares) || !g_check.scratch ||
+        ws_init(&pool, (unsigned)jobs) != 0) {
+        perror("Memory allocation failed");
+        free(g_check.scratch);
+        free(g_check.shares);
+        free(g_check.seen);
+        free(g_check.refs);
+        free(g_check.children);
+        pthread_mutex_destroy(&g_check.report_lock);
+        fs_close(&fs);
+        return -1;
+    }
+
+    check_superblock_ext(&fs);
+
+    // Inodes, their block maps and directory entries
+    for (uint64_t first = 0; first < fs.sb->inode_count; first += CHECK_INODES_PER_TASK) {
+        uint64_t n = fs.sb->inode_count - first < CHECK_INODES_PER_TASK ? fs.sb->inode_count - first
+                                                                        : CHECK_INODES_PER_TASK;
+        ws_push(&pool, check_inode_range, NULL, first, n);
+    }
+    if (dedup && fs.ext->dedup_index_ino != 0 && fs.ext->dedup_index_ino <= fs.sb->inode_count) {
+        check_push_ranges(&pool, check_dedup_index_range, fs.ext->dedup_index_ino, dedup_index_blocks(&fs));
+    }
+    ws_run(&pool);
+
+    // Used blocks nothing references
+    for (uint64_t first = 0; first < fs.sb->data_region_blocks; first += CHECK_BITS_PER_TASK) {
+        uint64_t n = fs.sb->data_region_blocks - first < CHECK_BITS_PER_TASK ? fs.sb->data_region_blocks - first
+                                                                              : CHECK_BITS_PER_TASK;
+        ws_push(&pool, check_bitmap_range, NULL, first, n);
+    }
+    ws_run(&pool);
+    ws_destroy(&pool);
+
+    check_links(&fs);
+
+    uint64_t problems = g_check.problems;
+    if (problems > CHECK_MAX_REPORTS) {
+        printf("... %" PRIu64 " more\n", problems - CHECK_MAX_REPORTS);
+    }
+    printf("%s: %" PRIu64 " problem%s found\n", image_path, problems, problems == 1 ? "" : "s");
+
+    free(g_check.scratch);
+    free(g_check.shares);
+    free(g_check.seen);
+    free(g_check.refs);
+    free(g_check.children);
+    pthread_mutex_destroy(&g_check.report_lock);
+    fs_close(&fs);
+    return problems == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    char* image_path;
+    int jobs;
+    if (parse_args(argc, argv, &image_path, &jobs) != 0) {
+        fprintf(stderr, "Usage: %s --image <image.img> [--jobs <n>]\n", argv[0]);
+        return 2;
+    }
+
+    int rc = check_filesystem(image_path, jobs);
+    return rc < 0 ? 2 : rc;
+}
@@ -0,0 +1,635 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_defrag_final.c -o mkfs_defrag
+#include "minivsfs.h"
+
+typedef struct {
+    char* input_path;
+    char* output_path;        // defragment a copy instead of the input image
+    int shrink;               // pack everything to the front and truncate the image
+} defrag_args_t;
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --input <image.img> [--output <output.img>] [--shrink]\n", prog_name);
+}
+
+int parse_args(int argc, char* argv[], defrag_args_t* args) {
+    memset(args, 0, sizeof(*args));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shrink") == 0) {
+            args->shrink = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return -1;
+        }
+        if (strcmp(argv[i], "--input") == 0) {
+            args->input_path = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            args->output_path = argv[++i];
+        } else {
+            return -1;
+        }
+    }
+    return args->input_path ? 0 : -1;
+}
+
+// ==================================FRAG MAP===================================
+// The fragmentation map comes from the block maps: every used data block
+// knows the image offset of the pointer to it (in an inode or a pointer
+// block), so a block can be moved by copying it and rewriting that one
+// pointer. A file is contiguous when its data blocks, in file order, and then
+// its pointer blocks, in the order inode_set_block_map lays them out, are one
+// run: the layout the builder and the adder produce.
+//
+// On a deduplicated image a data block may be shared: its other owners are
+// chained from share_head, and a move repoints them all and carries the
+// block's refcount and hash index entry along. A shared block is laid out
+// with the first file that has it.
+
+typedef struct {
+    uint32_t inode_no;
+    uint32_t first;           // first block of the file, in layout order
+    uint64_t blocks;
+    uint64_t extents;         // runs of consecutive blocks
+} defrag_file_t;
+
+typedef struct {
+    uint64_t owner;           // image offset of one more pointer to a shared block
+    uint32_t next;            // index + 1 of the next one, 0 at the end
+} defrag_share_t;
+
+typedef struct {
+    fs_image_t* fs;
+    uint64_t* owner;          // per data block: image offset of the pointer to it (0 if free)
+    uint32_t* share_head;     // dedup: per data block, index + 1 of its first other owner
+    defrag_share_t* shares;
+    uint64_t share_count;
+    uint64_t share_cap;
+    uint8_t* meta;            // per data block: it is a pointer block
+    uint32_t* pos;            // index + 1 of a block in the file being placed
+    defrag_file_t* files;
+    uint64_t file_count;
+    block_list_t list;        // blocks of the file last walked, in layout order
+    block_list_t ptrs;        // its pointer blocks, while walking
+    block_list_t from;        // a batch of moves
+    block_list_t to;
+    uint64_t moved;           // blocks copied
+} defrag_t;
+
+// Chain one more owner of a shared block
+int defrag_share_add(defrag_t* d, uint32_t blk, uint64_t off) {
+    if (d->share_count == d->share_cap) {
+        uint64_t cap = d->share_cap ? d->share_cap * 2 : 1024;
+        defrag_share_t* grown = realloc(d->shares, cap * sizeof(defrag_share_t));
+        if (!grown) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        d->shares = grown;
+        d->share_cap = cap;
+    }
+    d->shares[d->share_count] = (defrag_share_t){ off, d->share_head[blk - 1] };
+    d->share_head[blk - 1] = (uint32_t)++d->share_count;
+    return 0;
+}
+
+// Replace the owner of blk at image offset from with to
+void defrag_owner_moved(defrag_t* d, uint32_t blk, uint64_t from, uint64_t to) {
+    if (d->owner[blk - 1] == from) {
+        d->owner[blk - 1] = to;
+        return;
+    }
+    for (uint32_t s = d->share_head ? d->share_head[blk - 1] : 0; s != 0; s = d->shares[s - 1].next) {
+        if (d->shares[s - 1].owner == from) {
+            d->shares[s - 1].owner = to;
+            return;
+        }
+    }
+}
+
+int defrag_shared(const defrag_t* d, uint32_t blk) {
+    return d->share_head && d->share_head[blk - 1] != 0;
+}
+
+// Walk the blocks under the pointer at image offset off, depth levels above
+// the data: data blocks go to d->list in file order, pointer blocks to
+// d->ptrs in pre-order. With claim set the pointer is recorded as the block's
+// owner, and a block pointed at twice is an error unless it is shared data.
+int defrag_walk(defrag_t* d, uint64_t off, int depth, int claim) {
+    fs_image_t* fs = d->fs;
+    uint32_t blk = *(const uint32_t*)(fs->img_data + off);
+    if (blk == 0) {
+        return 0;
+    }
+    if (blk > fs->sb->data_region_blocks) {
+        fprintf(stderr, "Block %u is out of range; run mkfs_check\n", blk);
+        return -1;
+    }
+    if (claim && d->owner[blk - 1] != 0) {
+        if (!d->share_head || depth > 0 || bitmap_test(d->meta, blk - 1)) {
+            fprintf(stderr, "Block %u is referenced twice; run mkfs_check\n", blk);
+            return -1;
+        }
+        return defrag_share_add(d, blk, off); // listed with the first owner
+    }
+    if (claim) {
+        d->owner[blk - 1] = off;
+        if (depth > 0) {
+            bitmap_set(d->meta, blk - 1);
+        }
+    }
+    if (block_list_add(depth == 0 ? &d->list : &d->ptrs, blk) != 0) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    uint64_t ptrs = (uint64_t)(fs_block(fs, blk) - fs->img_data);
+    for (uint32_t k = 0; depth > 0 && k < PTRS_PER_BLOCK; k++) {
+        if (defrag_walk(d, ptrs + k * sizeof(uint32_t), depth - 1, claim) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The blocks of an inode in layout order, into d->list
+int defrag_file_blocks(defrag_t* d, uint32_t inode_no, int claim) {
+    fs_image_t* fs = d->fs;
+    inode_t* ino = fs_inode(fs, inode_no);
+    d->list.count = 0;
+    d->ptrs.count = 0;
+    for (int i = 0; i < DIRECT_MAX; i++) {
+        if (defrag_walk(d, (uint64_t)((uint8_t*)&ino->direct[i] - fs->img_data), 0, claim) != 0) {
+            return -1;
+        }
+    }
+    if (defrag_walk(d, (uint64_t)((uint8_t*)&ino->indirect - fs->img_data), 1, claim) != 0 ||
+        defrag_walk(d, (uint64_t)((uint8_t*)&ino->double_indirect - fs->img_data), 2, claim) != 0 ||
+        defrag_walk(d, (uint64_t)((uint8_t*)&ino->triple_indirect - fs->img_data), 3, claim) != 0) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < d->ptrs.count; i++) {
+        if (block_list_add(&d->list, d->ptrs.blocks[i]) != 0) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint64_t block_list_extents(const block_list_t* list) {
+    uint64_t extents = 0;
+    for (uint64_t i = 0; i < list->count; i++) {
+        extents += i == 0 || list->blocks[i] != list->blocks[i - 1] + 1;
+    }
+    return extents;
+}
+
+// Build the fragmentation map: every file with blocks, and with claim set the
+// owner of every block. Fails on an image whose maps and bitmap disagree.
+int defrag_scan(defrag_t* d, int claim) {
+    fs_image_t* fs = d->fs;
+    d->file_count = 0;
+    for (uint64_t bit = 0; bit < fs->sb->inode_count; bit++) {
+        if (!bitmap_test(fs->inode_bitmap, bit)) {
+            continue;
+        }
+        if (defrag_file_blocks(d, (uint32_t)(bit + 1), claim) != 0) {
+            return -1;
+        }
+        if (d->list.count == 0) {
+            continue;
+        }
+        defrag_file_t* f = &d->files[d->file_count++];
+        f->inode_no = (uint32_t)(bit + 1);
+        f->first = d->list.blocks[0];
+        f->blocks = d->list.count;
+        f->extents = block_list_extents(&d->list);
+    }
+
+    for (uint64_t bit = 0; claim && bit < fs->sb->data_region_blocks; bit++) {
+        if (bitmap_test(fs->data_bitmap, bit) != (d->owner[bit] != 0)) {
+            fprintf(stderr, "Data block %" PRIu64 " is %s; run mkfs_check\n", bit + 1,
+                    d->owner[bit] ? "in use but marked free" : "marked used but not referenced");
+            return -1;
+        }
+        if (!d->share_head || d->owner[bit] == 0 || bitmap_test(d->meta, bit)) {
+            continue;
+        }
+        uint64_t refs = 1;
+        for (uint32_t s = d->share_head[bit]; s != 0; s = d->shares[s - 1].next) {
+            refs++;
+        }
+        uint16_t refcount = dedup_refcount(fs, (uint32_t)(bit + 1));
+        if (refcount == 0 ? refs > 1 : refs != refcount) {
+            fprintf(stderr, "Data block %" PRIu64 " has refcount %u but %" PRIu64 " references; run mkfs_check\n",
+                    bit + 1, refcount, refs);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void defrag_report(const defrag_t* d, const char* when) {
+    const fs_image_t* fs = d->fs;
+    uint64_t extents = 0, fragmented = 0;
+    for (uint64_t i = 0; i < d->file_count; i++) {
+        extents += d->files[i].extents;
+        fragmented += d->files[i].extents > 1;
+    }
+    uint64_t runs = 0, largest = 0, run = 0;
+    for (uint64_t bit = 0; bit <= fs->sb->data_region_blocks; bit++) {
+        if (bit < fs->sb->data_region_blocks && !bitmap_test(fs->data_bitmap, bit)) {
+            run++;
+            continue;
+        }
+        runs += run > 0;
+        largest = run > largest ? run : largest;
+        run = 0;
+    }
+    printf("%s: %" PRIu64 " files in %" PRIu64 " extents (%" PRIu64 " fragmented); free space in %" PRIu64
+           " runs, largest %" PRIu64 " blocks\n",
+           when, d->file_count, extents, fragmented, runs, largest);
+}
+
+// ==================================MIGRATION==================================
+// Blocks are moved in batches: claim the targets, copy, flush the copies to
+// the image file, and only then repoint the owners and free the sources. A
+// batch interrupted before it is repointed leaves the old blocks in use. The
+// repointed owners are flushed before the batch returns, so no later batch
+// copies into a freed source while a pointer on disk still refers to it. On a
+// deduplicated image the refcounts and index entries follow once every block
+// of the batch (the tables' own blocks too) is repointed.
+
+// Point the pointer at image offset off at blk
+void defrag_repoint(defrag_t* d, uint64_t off, uint32_t blk) {
+    fs_image_t* fs = d->fs;
+    uint64_t itable = fs->sb->inode_table_start * BS;
+    *(uint32_t*)(fs->img_data + off) = blk;
+    if (off >= itable && off < itable + fs->sb->inode_table_blocks * BS) {
+        inode_checksum(fs_inode(fs, (uint32_t)((off - itable) / INODE_SIZE + 1)));
+    }
+}
+
+// A data block of a deduplicated image moved from from to to: its refcount
+// and its hash index entry go with it
+int defrag_dedup_moved(defrag_t* d, uint32_t from, uint32_t to) {
+    fs_image_t* fs = d->fs;
+    uint16_t count = bitmap_test(d->meta, to - 1) ? 0 : dedup_refcount(fs, from);
+    if (count == 0) {
+        return 0; // a pointer block, or data stored without dedup
+    }
+    if (dedup_refcount_set(fs, to, count) != 0) {
+        fprintf(stderr, "No refcount table block for data block %u\n", to);
+        return -1;
+    }
+    dedup_refcount_set(fs, from, 0);
+    uint64_t hash[2];
+    dedup_hash(fs_block(fs, to), hash);
+    dedup_entry_t* e = dedup_probe(fs, hash, from, NULL, NULL);
+    if (e != NULL) {
+        e->block = to;
+    }
+    return 0;
+}
+
+// Move blocks d->from[i] to the free blocks d->to[i]
+int defrag_move(defrag_t* d) {
+    fs_image_t* fs = d->fs;
+    uint64_t count = d->from.count;
+    for (uint64_t i = 0; i < count; i++) {
+        bitmap_set(fs->data_bitmap, d->to.blocks[i] - 1);
+        memcpy(fs_block(fs, d->to.blocks[i]), fs_block(fs, d->from.blocks[i]), BS);
+    }
+    if (count > 0 && msync(fs->img_data, fs->img_size, MS_SYNC) != 0) {
+        perror("Failed to flush moved blocks");
+        return -1;
+    }
+
+    // The pointers inside a moved pointer block now live in its copy
+    for (uint64_t i = 0; i < count; i++) {
+        uint32_t to = d->to.blocks[i];
+        if (!bitmap_test(d->meta, d->from.blocks[i] - 1)) {
+            continue;
+        }
+        const uint32_t* ptrs = (const uint32_t*)fs_block(fs, to);
+        uint64_t old = (uint64_t)(fs_block(fs, d->from.blocks[i]) - fs->img_data);
+        for (uint32_t k = 0; k < PTRS_PER_BLOCK; k++) {
+            if (ptrs[k] != 0) {
+                defrag_owner_moved(d, ptrs[k], old + k * sizeof(uint32_t),
+                                   (uint64_t)((const uint8_t*)&ptrs[k] - fs->img_data));
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint32_t from = d->from.blocks[i], to = d->to.blocks[i];
+        defrag_repoint(d, d->owner[from - 1], to);
+        for (uint32_t s = defrag_shared(d, from) ? d->share_head[from - 1] : 0; s != 0; s = d->shares[s - 1].next) {
+            defrag_repoint(d, d->shares[s - 1].owner, to);
+        }
+        d->owner[to - 1] = d->owner[from - 1];
+        d->owner[from - 1] = 0;
+        if (d->share_head) {
+            d->share_head[to - 1] = d->share_head[from - 1];
+            d->share_head[from - 1] = 0;
+        }
+        if (bitmap_test(d->meta, from - 1)) {
+            bitmap_clear(d->meta, from - 1);
+            bitmap_set(d->meta, to - 1);
+        }
+        fs_free_block(fs, from);
+    }
+    for (uint64_t i = 0; d->share_head && i < count; i++) {
+        if (defrag_dedup_moved(d, d->from.blocks[i], d->to.blocks[i]) != 0) {
+            return -1;
+        }
+    }
+    if (count > 0 && msync(fs->img_data, fs->img_size, MS_SYNC) != 0) {
+        perror("Failed to flush moved block pointers");
+        return -1;
+    }
+    d->moved += count;
+    d->from.count = 0;
+    d->to.count = 0;
+    return 0;
+}
+
+int defrag_plan(defrag_t* d, uint32_t from, uint32_t to) {
+    if (block_list_add(&d->from, from) != 0 || block_list_add(&d->to, to) != 0) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    return 0;
+}
+
+// First free bit in [start, end), or end
+uint64_t defrag_find_free(const fs_image_t* fs, uint64_t start, uint64_t end) {
+    const uint64_t* words = (const uint64_t*)fs->data_bitmap;
+    for (uint64_t bit = start; bit < end; bit++) {
+        if (bit % 64 == 0 && bit + 64 <= end && words[bit / 64] == UINT64_MAX) {
+            bit += 63; // a full word
+            continue;
+        }
+        if (!bitmap_test(fs->data_bitmap, bit)) {
+            return bit;
+        }
+    }
+    return end;
+}
+
+// First run of n free blocks, as the bit of its first block, or UINT64_MAX
+uint64_t defrag_find_run(const fs_image_t* fs, uint64_t n) {
+    uint64_t nbits = fs->sb->data_region_blocks;
+    uint64_t bit = defrag_find_free(fs, fs->data_hint, nbits);
+    while (bit + n <= nbits) {
+        uint64_t end = bit + 1;
+        while (end < bit + n && !bitmap_test(fs->data_bitmap, end)) {
+            end++;
+        }
+        if (end == bit + n) {
+            return bit;
+        }
+        bit = defrag_find_free(fs, end, nbits);
+    }
+    return UINT64_MAX;
+}
+
+// Drop from d->list the shared blocks it already has, and with placed set
+// those before block placed (laid out with an earlier file). Sets d->pos.
+void defrag_list_unique(defrag_t* d, uint32_t placed) {
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < d->list.count; i++) {
+        uint32_t blk = d->list.blocks[i];
+        if (defrag_shared(d, blk) && (blk < placed || d->pos[blk - 1] != 0)) {
+            continue;
+        }
+        d->list.blocks[n++] = blk;
+        d->pos[blk - 1] = (uint32_t)n;
+    }
+    d->list.count = n;
+}
+
+// Move each fragmented file whole to the first free run it fits in
+int defrag_files(defrag_t* d, uint64_t* made, uint64_t* skipped) {
+    for (uint64_t f = 0; f < d->file_count; f++) {
+        if (d->files[f].extents <= 1) {
+            continue;
+        }
+        if (defrag_file_blocks(d, d->files[f].inode_no, 0) != 0) {
+            return -1;
+        }
+        defrag_list_unique(d, 0);
+        for (uint64_t i = 0; i < d->list.count; i++) {
+            d->pos[d->list.blocks[i] - 1] = 0;
+        }
+        uint64_t start = defrag_find_run(d->fs, d->list.count);
+        if (start == UINT64_MAX) {
+            (*skipped)++;
+            continue;
+        }
+        for (uint64_t i = 0; i < d->list.count; i++) {
+            if (defrag_plan(d, d->list.blocks[i], (uint32_t)(start + i + 1)) != 0) {
+                return -1;
+            }
+        }
+        if (defrag_move(d) != 0) {
+            return -1;
+        }
+        (*made)++;
+    }
+    return 0;
+}
+
+int compare_files_by_first(const void* a, const void* b) {
+    uint32_t x = ((const defrag_file_t*)a)->first, y = ((const defrag_file_t*)b)->first;
+    return (x > y) - (x < y);
+}
+
+// --shrink: lay every file out contiguously from block 1, in the order the
+// files start in now. Blocks in the way are first moved out of the file's
+// target range, then the file is moved in. Returns the blocks now in use.
+int64_t defrag_pack(defrag_t* d) {
+    fs_image_t* fs = d->fs;
+    uint64_t nbits = fs->sb->data_region_blocks;
+    uint64_t next = 1;        // first block of the next file
+    uint64_t spare = 0;       // where to look for free blocks to move others to
+    qsort(d->files, d->file_count, sizeof(defrag_file_t), compare_files_by_first);
+
+    for (uint64_t f = 0; f < d->file_count; f++) {
+        if (defrag_file_blocks(d, d->files[f].inode_no, 0) != 0) {
+            return -1;
+        }
+        defrag_list_unique(d, (uint32_t)next);
+        uint32_t* list = d->list.blocks;
+        uint64_t n = d->list.count;
+
+        // Clear the target range of anything not already in its place
+        for (uint64_t i = 0; i < n; i++) {
+            uint32_t t = (uint32_t)(next + i);
+            if (!bitmap_test(fs->data_bitmap, t - 1) || list[i] == t) {
+                continue;
+            }
+            uint64_t lo = next + n - 1; // first bit past the range
+            uint64_t bit = defrag_find_free(fs, spare > lo ? spare : lo, nbits);
+            if (bit == nbits) {
+                bit = defrag_find_free(fs, lo, nbits);
+            }
+            if (bit == nbits) {
+                fprintf(stderr, "Not enough free space to pack inode %u\n", d->files[f].inode_no);
+                return -1;
+            }
+            bitmap_set(fs->data_bitmap, bit); // claimed, so the next search passes it
+            spare = bit + 1;
+            uint32_t e = (uint32_t)(bit + 1);
+            if (d->pos[t - 1] != 0) {
+                list[d->pos[t - 1] - 1] = e; // a block of this file, out of order
+                d->pos[e - 1] = d->pos[t - 1];
+                d->pos[t - 1] = 0;
+            }
+            if (defrag_plan(d, t, e) != 0) {
+                return -1;
+            }
+        }
+        if (defrag_move(d) != 0) {
+            return -1;
+        }
+
+        for (uint64_t i = 0; i < n; i++) {
+            d->pos[list[i] - 1] = 0;
+            if (list[i] != next + i && defrag_plan(d, list[i], (uint32_t)(next + i)) != 0) {
+                return -1;
+            }
+        }
+        if (defrag_move(d) != 0) {
+            return -1;
+        }
+        next += n;
+    }
+    return (int64_t)(next - 1);
+}
+
+// Truncate the data region after its last used block. The bitmaps and inode
+// table stay where they are and the data bitmap keeps its size, unless
+// mkfs_resize moved it to the end of the image: then it follows the data
+// region down and shrinks with it.
+void shrink_image(fs_image_t* fs, uint64_t used) {
+    superblock_t* sb = fs->sb;
+    uint64_t blocks = used > 0 ? used : 1; // the layout keeps at least one data block
+    if (blocks >= sb->data_region_blocks) {
+        return;
+    }
+    dedup_region_resize(fs, blocks);
+    sb->total_blocks = sb->data_region_start + blocks;
+    if (sb->data_bitmap_start >= sb->data_region_start) {
+        sb->data_bitmap_start = sb->total_blocks;
+        sb->data_bitmap_blocks = (blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        uint8_t* bitmap = fs->img_data + sb->data_bitmap_start * BS;
+        memmove(bitmap, fs->data_bitmap, sb->data_bitmap_blocks * BS);
+        fs->data_bitmap = bitmap;
+        sb->total_blocks += sb->data_bitmap_blocks;
+    }
+    sb->data_region_blocks = blocks;
+    if (fs->data_hint > blocks) {
+        fs->data_hint = blocks;
+    }
+}
+
+// Allocate every block of the dedup refcount table up front, so a moved
+// block's refcount never needs a new table block in the middle of a batch
+int defrag_dedup_tables(fs_image_t* fs) {
+    const inode_t* ino = fs_inode(fs, fs->ext->dedup_refcount_ino);
+    for (uint64_t b = 0; b < ino->size_bytes / BS; b++) {
+        if (!dedup_table_block(fs, fs->ext->dedup_refcount_ino, b, 1)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int defrag_filesystem(const defrag_args_t* args) {
+    fs_image_t fs;
+    if (fs_open(&fs, args->input_path, args->output_path, 0) != 0) {
+        return -1;
+    }
+    int dedup = (fs.sb->flags & SB_FLAG_DEDUP) != 0;
+
+    defrag_t d;
+    memset(&d, 0, sizeof(d));
+    d.fs = &fs;
+    uint64_t nbits = fs.sb->data_region_blocks;
+    d.owner = calloc(nbits, sizeof(uint64_t));
+    d.meta = calloc(nbits / 8 + 8, 1);
+    d.pos = calloc(nbits, sizeof(uint32_t));
+    d.share_head = dedup ? calloc(nbits, sizeof(uint32_t)) : NULL;
+    d.files = malloc(fs.sb->inode_count * sizeof(defrag_file_t));
+    int rc = -1;
+    if (!d.owner || !d.meta || !d.pos || (dedup && !d.share_head) || !d.files) {
+        perror("Memory allocation failed");
+    } else if (dedup && defrag_dedup_tables(&fs) != 0) {
+        fprintf(stderr, "Not enough free data blocks for the dedup refcount table\n");
+    } else if (defrag_scan(&d, 1) == 0) {
+        defrag_report(&d, "Before");
+        uint64_t made = 0, skipped = 0;
+        int64_t used = 0;
+        if (args->shrink) {
+            used = defrag_pack(&d);
+            rc = used < 0 ? -1 : 0;
+        } else {
+            rc = defrag_files(&d, &made, &skipped);
+        }
+        printf("Moved %" PRIu64 " blocks\n", d.moved);
+        if (!args->shrink) {
+            printf("Made %" PRIu64 " files contiguous", made);
+            if (skipped > 0) {
+                printf(", %" PRIu64 " left as they were (no free run long enough; try --shrink)", skipped);
+            }
+            printf("\n");
+        }
+
+        uint64_t old_total = fs.sb->total_blocks;
+        if (rc == 0 && args->shrink) {
+            shrink_image(&fs, (uint64_t)used);
+        }
+        alloc_hint_advance(fs.data_bitmap, fs.sb->data_region_blocks, &fs.data_hint, fs.data_hint);
+        fs_commit(&fs, time(NULL));
+        if (defrag_scan(&d, 0) == 0) {
+            defrag_report(&d, "After");
+        }
+        if (fs.sb->total_blocks < old_total) {
+            printf("Shrank image from %" PRIu64 " to %" PRIu64 " blocks\n", old_total, fs.sb->total_blocks);
+        }
+    }
+
+    free(d.owner);
+    free(d.meta);
+    free(d.pos);
+    free(d.share_head);
+    free(d.shares);
+    free(d.files);
+    free(d.list.blocks);
+    free(d.ptrs.blocks);
+    free(d.from.blocks);
+    free(d.to.blocks);
+    uint64_t total = fs.sb->total_blocks;
+    if (fs_close(&fs) != 0) {
+        return -1;
+    }
+
+    // Give the space after the data region back to the host
+    const char* path = args->output_path ? args->output_path : args->input_path;
+    if (rc == 0 && args->shrink && truncate(path, (off_t)(total * BS)) != 0) {
+        perror("Failed to truncate image file");
+        return -1;
+    }
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    defrag_args_t args;
+    if (parse_args(argc, argv, &args) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    return defrag_filesystem(&args) == 0 ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_resize_final.c -o mkfs_resize
+#include "minivsfs.h"
+
+typedef struct {
+    char* input_path;
+    char* output_path;        // resize a copy instead of the input image
+    int grow;
+    uint64_t size_kib;        // new image size
+} resize_args_t;
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --input <image.img> [--output <output.img>] --grow --size-kib <n>\n", prog_name);
+}
+
+int parse_args(int argc, char* argv[], resize_args_t* args) {
+    memset(args, 0, sizeof(*args));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--grow") == 0) {
+            args->grow = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return -1;
+        }
+        if (strcmp(argv[i], "--input") == 0) {
+            args->input_path = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            args->output_path = argv[++i];
+        } else if (strcmp(argv[i], "--size-kib") == 0) {
+            args->size_kib = strtoull(argv[++i], NULL, 10);
+        } else {
+            return -1;
+        }
+    }
+    if (args->input_path && args->size_kib > 0 && !args->grow) {
+        fprintf(stderr, "Only --grow is supported; mkfs_defrag --shrink shrinks an image\n");
+    }
+    return args->input_path && args->grow && args->size_kib > 0 ? 0 : -1;
+}
+
+// Lay the data bitmap out for the grown layout in sb. The new blocks of a
+// bitmap grown in place are zeroed; a moved bitmap is copied and the rest of
+// it zeroed. Both only touch bitmap blocks: the inode table and data stay.
+int grow_data_bitmap(fs_image_t* fs, const superblock_t* sb) {
+    uint8_t* bitmap = fs->img_data + sb->data_bitmap_start * BS;
+    uint64_t used_bytes = (fs->sb->data_region_blocks + 7) / 8;
+    if (bitmap != fs->data_bitmap) {
+        memcpy(bitmap, fs->data_bitmap, used_bytes);
+    }
+    memset(bitmap + used_bytes, 0, sb->data_bitmap_blocks * BS - used_bytes);
+
+    // The bitmap is on disk before the superblock points at it
+    if (msync(fs->img_data, fs->img_size, MS_SYNC) != 0) {
+        perror("Failed to flush data bitmap");
+        return -1;
+    }
+    fs->data_bitmap = bitmap;
+    return 0;
+}
+
+int grow_filesystem(const resize_args_t* args) {
+    fs_image_t fs;
+    if (fs_open(&fs, args->input_path, args->output_path, 0) != 0) {
+        return -1;
+    }
+    superblock_t sb = *fs.sb;
+    uint64_t old_total = sb.total_blocks, old_data = sb.data_region_blocks, old_bitmap = sb.data_bitmap_start;
+    int grown = layout_grow(&sb, args->size_kib * 1024 / BS);
+    if (fs_close(&fs) != 0) {
+        return -1;
+    }
+    if (grown != 0) {
+        fprintf(stderr, "Cannot grow the image from %" PRIu64 " KiB to %" PRIu64 " KiB: it must grow by more than its"
+                " data bitmap and keep the data region within %" PRIu64 " blocks\n",
+                old_total * BS / 1024, args->size_kib, MAX_DATA_BLOCKS);
+        return -1;
+    }
+
+    // Extend the file first: an image longer than its superblock says is
+    // still valid, so nothing is lost if the grow stops here
+    const char* path = args->output_path ? args->output_path : args->input_path;
+    if (truncate(path, (off_t)(sb.total_blocks * BS)) != 0) {
+        perror("Failed to extend image file");
+        return -1;
+    }
+    if (fs_open(&fs, path, NULL, 0) != 0) {
+        return -1;
+    }
+
+    int rc = grow_data_bitmap(&fs, &sb);
+    if (rc == 0) {
+        dedup_region_resize(&fs, sb.data_region_blocks);
+        fs.sb->total_blocks = sb.total_blocks;
+        fs.sb->data_region_blocks = sb.data_region_blocks;
+        fs.sb->data_bitmap_start = sb.data_bitmap_start;
+        fs.sb->data_bitmap_blocks = sb.data_bitmap_blocks;
+        fs_commit(&fs, time(NULL));
+
+        printf("Grew image from %" PRIu64 " to %" PRIu64 " blocks (%" PRIu64 " more data blocks)\n", old_total,
+               sb.total_blocks, sb.data_region_blocks - old_data);
+        if (sb.data_bitmap_start != old_bitmap) {
+            printf("Moved the data bitmap to block %" PRIu64 " (%" PRIu64 " blocks)\n", sb.data_bitmap_start,
+                   sb.data_bitmap_blocks);
+        }
+    }
+    if (fs_close(&fs) != 0) {
+        return -1;
+    }
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    resize_args_t args;
+    if (parse_args(argc, argv, &args) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    return grow_filesystem(&args) == 0 ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_rm_final.c -o mkfs_rm
+#include "minivsfs.h"
+
+typedef struct {
+    char* input_path;
+    char* output_path;        // update a copy instead of the input image
+    char** names;             // --file may be given more than once
+    int name_count;
+    int discard;              // punch the freed blocks out of the image file
+} rm_args_t;
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --input <image.img> [--output <output.img>] --file <name> [--file <name> ...] [--discard]\n",
+            prog_name);
+}
+
+int parse_args(int argc, char* argv[], rm_args_t* args) {
+    memset(args, 0, sizeof(*args));
+    args->names = calloc((size_t)argc, sizeof(char*));
+    if (!args->names) {
+        return -1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--discard") == 0) {
+            args->discard = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return -1;
+        }
+        if (strcmp(argv[i], "--input") == 0) {
+            args->input_path = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            args->output_path = argv[++i];
+        } else if (strcmp(argv[i], "--file") == 0) {
+            args->names[args->name_count++] = argv[++i];
+        } else {
+            return -1;
+        }
+    }
+    return args->input_path && args->name_count > 0 ? 0 : -1;
+}
+
+// Remove every name from the root directory and commit once
+int remove_files_from_filesystem(const rm_args_t* args) {
+    fs_image_t fs;
+    if (fs_open(&fs, args->input_path, args->output_path, 0) != 0) {
+        return -1;
+    }
+
+    block_list_t freed = { NULL, 0, 0 };
+    int removed = 0;
+    for (int i = 0; i < args->name_count; i++) {
+        const char* err;
+        uint64_t blocks;
+        if (fs_remove_file(&fs, args->names[i], args->discard ? &freed : NULL, &blocks, &err) != 0) {
+            perror(err);
+            continue;
+        }
+        printf("Successfully removed file %s from filesystem\n", args->names[i]);
+        if (blocks > 0) {
+            printf("Released %" PRIu64 " data blocks\n", blocks);
+        }
+        removed++;
+    }
+
+    // Superblock timestamp, allocation hints and checksum
+    fs_commit(&fs, time(NULL));
+
+    if (args->discard && freed.count > 0) {
+        int64_t discarded = fs_discard_blocks(&fs, &freed);
+        if (discarded < 0) {
+            perror("Failed to discard freed blocks");
+        } else {
+            printf("Discarded %" PRId64 " blocks from the image file\n", discarded);
+        }
+    }
+    free(freed.blocks);
+
+    if (fs_close(&fs) != 0) {
+        return -1;
+    }
+    return removed == args->name_count ? 0 : -1;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    rm_args_t args;
+    if (parse_args(argc, argv, &args) != 0) {
+        print_usage(argv[0]);
+        free(args.names);
+        return 1;
+    }
+
+    int rc = remove_files_from_filesystem(&args);
+    free(args.names);
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread test_alloc.c -o test_alloc
+// Stress test of the lock-free allocator: worker threads allocate and free
+// data blocks at random on a small bitmap, so claims, frees and hint moves
+// race on the same words. Between rounds, with the workers stopped, it checks
+// that no block was handed out twice, that every bit below the shared hint is
+// set (a block freed under a moving hint is not lost), and at the end that
+// freeing everything brings the hint back to block 1.
+//
+//   ./test_alloc [threads] [rounds]
+#include "minivsfs.h"
+
+#define TEST_BLOCKS 4096u
+#define TEST_HELD 64u           // blocks each worker keeps at most
+#define TEST_OPS 20000u         // allocations per worker per round
+
+typedef struct {
+    fs_image_t* fs;
+    uint8_t* owner;             // per block: worker that holds it + 1
+    unsigned id;
+    unsigned seed;
+    uint32_t held[TEST_HELD];
+    unsigned held_count;
+    int failed;
+} test_worker_t;
+
+unsigned test_rand(unsigned* seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 16;
+}
+
+void test_free_one(test_worker_t* w, unsigned i) {
+    uint32_t blk = w->held[i];
+    __atomic_store_n(&w->owner[blk - 1], 0, __ATOMIC_RELAXED);
+    w->held[i] = w->held[--w->held_count];
+    fs_free_block(w->fs, blk);
+}
+
+void* test_worker(void* arg) {
+    test_worker_t* w = arg;
+    for (unsigned op = 0; op < TEST_OPS && !w->failed; op++) {
+        unsigned want = 1 + test_rand(&w->seed) % 4;
+        while (w->held_count > 0 && (w->held_count + want > TEST_HELD || test_rand(&w->seed) % 2)) {
+            test_free_one(w, test_rand(&w->seed) % w->held_count);
+        }
+        uint32_t got[4];
+        if (fs_alloc_blocks(w->fs, got, want) != 0) {
+            continue; // full for now: the others are holding the rest
+        }
+        for (unsigned i = 0; i < want; i++) {
+            uint8_t prev = __atomic_exchange_n(&w->owner[got[i] - 1], (uint8_t)(w->id + 1), __ATOMIC_RELAXED);
+            if (prev != 0) {
+                fprintf(stderr, "block %u handed to worker %u while worker %u holds it\n", got[i], w->id, prev - 1);
+                w->failed = 1;
+            }
+            w->held[w->held_count++] = got[i];
+        }
+    }
+    return NULL;
+}
+
+// With the workers stopped: every bit below the hint is set, and the bitmap
+// holds exactly the blocks the workers hold
+int test_check(const fs_image_t* fs, const uint8_t* owner, const char* when) {
+    int rc = 0;
+    for (uint64_t bit = 0; bit < TEST_BLOCKS; bit++) {
+        int used = bitmap_test(fs->data_bitmap, bit);
+        if (bit < fs->data_hint && !used) {
+            fprintf(stderr, "%s: block %" PRIu64 " is free but below the hint (%" PRIu64 ")\n", when, bit + 1,
+                    fs->data_hint);
+            rc = -1;
+            break;
+        }
+        if (used != (owner[bit] != 0)) {
+            fprintf(stderr, "%s: block %" PRIu64 " is %s\n", when, bit + 1, used ? "leaked" : "held but free");
+            rc = -1;
+            break;
+        }
+    }
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned threads = argc > 1 ? (unsigned)atoi(argv[1]) : 8;
+    unsigned rounds = argc > 2 ? (unsigned)atoi(argv[2]) : 50;
+    if (threads == 0 || threads > 64 || rounds == 0) {
+        fprintf(stderr, "Usage: %s [threads (1-64)] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    superblock_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.data_region_blocks = TEST_BLOCKS;
+    fs_image_t fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.sb = &sb;
+    fs.data_bitmap = calloc(1, BS);
+    uint8_t* owner = calloc(TEST_BLOCKS, 1);
+    test_worker_t* workers = calloc(threads, sizeof(test_worker_t));
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    if (!fs.data_bitmap || !owner || !workers || !tids) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+
+    int rc = 0;
+    for (unsigned r = 0; r < rounds && rc == 0; r++) {
+        for (unsigned t = 0; t < threads; t++) {
+            workers[t].fs = &fs;
+            workers[t].owner = owner;
+            workers[t].id = t;
+            workers[t].seed = workers[t].seed ? workers[t].seed : t * 7919u + 1;
+            pthread_create(&tids[t], NULL, test_worker, &workers[t]);
+        }
+        for (unsigned t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+            rc |= workers[t].failed ? -1 : 0;
+        }
+        rc |= test_check(&fs, owner, "after a round");
+    }
+
+    for (unsigned t = 0; t < threads; t++) {
+        while (workers[t].held_count > 0) {
+            test_free_one(&workers[t], 0);
+        }
+    }
+    rc |= test_check(&fs, owner, "after freeing everything");
+    if (rc == 0 && fs.data_hint != 0) {
+        fprintf(stderr, "after freeing everything: hint is at block %" PRIu64 ", not 1\n", fs.data_hint + 1);
+        rc = -1;
+    }
+
+    printf("test_alloc: %u threads, %u rounds: %s\n", threads, rounds, rc == 0 ? "ok" : "FAILED");
+    free(fs.data_bitmap);
+    free(owner);
+    free(workers);
+    free(tids);
+    return rc == 0 ? 0 : 1;
+}